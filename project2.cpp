@@ -8,256 +8,4286 @@
  * is computed and displayed.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CHIPSIM_X86_KERNELS 1   // Build the AVX2/AVX-512 batch kernels
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CHIPSIM_COMPUTED_GOTO 1 // Dispatch the bytecode VM through label addresses
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CHIPSIM_POSIX_IO 1      // Memory-map input files
+#endif
+
+#if defined(__x86_64__) && defined(CHIPSIM_POSIX_IO)
+#define CHIPSIM_X86_JIT 1       // Compile circuits to machine code for --engine=jit
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define CHIPSIM_PERF_COUNTERS 1 // Count cache misses in --bench
+#endif
+
 using namespace std;
 
-class Chip {
+// Compact 32-bit handle for a chip. Handles are assigned in declaration order
+// when IDs are interned, so they double as indexes into the chip array.
+typedef uint32_t ChipHandle;
+const ChipHandle NO_CHIP = UINT32_MAX;  // Handle value for "no chip"
+
+// Version of the compiled-circuit image format. Bump it whenever the layout
+// of anything written by the save() methods changes; images of any other
+// version are rejected on load.
+const uint32_t CIRCUIT_IMAGE_VERSION = 7;
+const char CIRCUIT_IMAGE_MAGIC[8] = { 'C', 'H', 'I', 'P', 'S', 'I', 'M', 'C' };
+const uint32_t CIRCUIT_IMAGE_BYTE_ORDER = 0x01020304;   // Detects images from a machine of other endianness
+
+// 128-bit fingerprint hash. It keys the circuit cache by the parts of a
+// netlist that determine the compiled circuit, and checksums circuit images.
+// Two independent 64-bit hashes are combined so accidental collisions are
+// out of reach in practice.
+class FingerprintHasher {
+private:
+    uint64_t first;    // FNV-1a over every byte or word
+    uint64_t second;   // Multiply-rotate hash over every byte or word
+
+    // Adds one 64-bit word; a byte is added as the word of its value
+    void addWord(uint64_t word) {
+        first = (first ^ word) * 0x100000001b3ull;
+        second = (second ^ (word * 0xff51afd7ed558ccdull)) * 0xc4ceb9fe1a85ec53ull;
+        second = (second << 31) | (second >> 33);
+    }
+
+public:
+    FingerprintHasher() {
+        first = 0xcbf29ce484222325ull;
+        second = 0x9e3779b97f4a7c15ull;
+    }
+
+    // Adds one token, followed by a separator so token boundaries count
+    void add(string_view token) {
+        for (char c : token) {
+            addByte((unsigned char)c);
+        }
+        addByte(0);
+    }
+
+    // Adds one byte
+    void addByte(unsigned char byte) {
+        addWord(byte);
+    }
+
+    // Adds a block of memory eight bytes at a time, the last word padded with
+    // zeros; much faster than add() for large binary sections. Whole 32-byte
+    // groups go through four independent lanes, so the multiplies overlap
+    // instead of waiting on each other, and the lanes are folded in at the
+    // end. The result therefore depends on how the bytes are split into calls.
+    void addPadded(const void* data, size_t bytes) {
+        addPadded(data, bytes, SIZE_MAX & ~(size_t)31, [](size_t) {});
+    }
+
+    // Adds a block like addPadded(data, bytes), calling visit(hashed) with
+    // the number of bytes hashed so far after every pieceBytes of it and at
+    // the end, so the caller can look at the block while the piece just
+    // hashed is still in cache. pieceBytes must be a multiple of 32.
+    template <typename Visit>
+    void addPadded(const void* data, size_t bytes, size_t pieceBytes, Visit visit) {
+        const char* p = static_cast<const char*>(data);
+        size_t total = bytes;
+        uint64_t word;
+        if (bytes >= 32) {
+            uint64_t lanes[4] = { first, second, ~first, ~second };
+            while (bytes >= 32) {
+                size_t piece = min(pieceBytes, bytes & ~(size_t)31);
+                for (const char* end = p + piece; p != end; p += 32) {
+                    for (int i = 0; i < 4; i++) {
+                        memcpy(&word, p + 8 * i, 8);
+                        lanes[i] = (lanes[i] ^ word) * 0xc4ceb9fe1a85ec53ull;
+                        lanes[i] = (lanes[i] << 31) | (lanes[i] >> 33);
+                    }
+                }
+                bytes -= piece;
+                visit(total - bytes);
+            }
+            for (uint64_t lane : lanes) {
+                addWord(lane);
+            }
+        }
+        for (; bytes >= 8; p += 8, bytes -= 8) {
+            memcpy(&word, p, 8);
+            addWord(word);
+        }
+        if (bytes > 0) {
+            word = 0;
+            memcpy(&word, p, bytes);
+            addWord(word);
+        }
+        visit(total);
+    }
+
+    // Returns the two halves of the fingerprint
+    void digest(uint64_t parts[2]) const {
+        parts[0] = first;
+        parts[1] = second;
+    }
+
+    // Returns the fingerprint as 32 hexadecimal digits
+    string hex() const {
+        static const char digits[] = "0123456789abcdef";
+        string text(32, '0');
+        uint64_t parts[2] = { first, second };
+        for (int i = 0; i < 32; i++) {
+            text[i] = digits[(parts[i / 16] >> (60 - 4 * (i % 16))) & 15];
+        }
+        return text;
+    }
+};
+
+// Array that either owns its elements or refers to a section of a loaded
+// circuit image, so an image is used where it lies instead of being copied
+// out. Reading works the same either way; edit() copies a referenced section
+// into owned storage before the first change, and rebuild() drops it.
+template <typename T>
+class ImageArray {
+private:
+    vector<T> owned;    // Elements, when the array owns them
+    const T* section;   // Elements in an image, or null when owned
+    size_t count;       // Number of elements in the image section
+
+public:
+    ImageArray() {
+        section = nullptr;
+        count = 0;
+    }
+
+    // Refers to count elements of an image, which must outlive the array
+    void refer(const T* data, size_t count) {
+        vector<T>().swap(owned);
+        section = data;
+        this->count = count;
+    }
+
+    // Returns the elements for changing, copied out of the image first if needed
+    vector<T>& edit() {
+        if (section != nullptr) {
+            owned.assign(section, section + count);
+            section = nullptr;
+        }
+        return owned;
+    }
+
+    // Returns empty owned storage to fill from scratch
+    vector<T>& rebuild() {
+        section = nullptr;
+        owned.clear();
+        return owned;
+    }
+
+    const T* data() const {
+        return section != nullptr ? section : owned.data();
+    }
+
+    size_t size() const {
+        return section != nullptr ? count : owned.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const T& operator[](size_t i) const {
+        return data()[i];
+    }
+
+    const T& back() const {
+        return data()[size() - 1];
+    }
+
+    const T* begin() const {
+        return data();
+    }
+
+    const T* end() const {
+        return data() + size();
+    }
+};
+
+// Writes the sections of a compiled-circuit image. Every array starts on an
+// 8-byte boundary so a loader can use it in place in a mapping, and a
+// checksum of everything before it ends the image.
+class ImageWriter {
+private:
+    FILE* file;                   // Destination
+    uint64_t offset;              // Bytes written so far
+    bool failed;                  // Set by the first failed write
+    FingerprintHasher checksum;   // Hash of every byte written so far
+
+public:
+    explicit ImageWriter(FILE* file) {
+        this->file = file;
+        offset = 0;
+        failed = false;
+    }
+
+    // Writes count elements followed by padding up to the next 8-byte boundary
+    template <typename T>
+    void writeArray(const T* data, uint64_t count) {
+        static const char padding[8] = { 0 };
+        size_t bytes = (size_t)count * sizeof(T);
+        if (bytes > 0 && fwrite(data, 1, bytes, file) != bytes) {
+            failed = true;
+        }
+        checksum.addPadded(data, bytes);   // The same words the padded bytes form, as ImageReader hashes them
+        offset += bytes;
+        size_t pad = (size_t)((8 - offset % 8) % 8);
+        if (pad > 0 && fwrite(padding, 1, pad, file) != pad) {
+            failed = true;
+        }
+        offset += pad;
+    }
+
+    // Writes a single value as a one-element array
+    template <typename T>
+    void writeValue(const T& value) {
+        writeArray(&value, 1);
+    }
+
+    // Ends the image with the checksum of everything written before
+    void writeChecksum() {
+        uint64_t parts[2];
+        checksum.digest(parts);
+        if (fwrite(parts, 1, sizeof(parts), file) != sizeof(parts)) {
+            failed = true;
+        }
+        offset += sizeof(parts);
+    }
+
+    // Returns true if every write succeeded
+    bool ok() const {
+        return !failed;
+    }
+};
+
+// Reads the sections of a compiled-circuit image from memory, checking every
+// section against the bytes that are actually there and hashing it for the
+// checksum at the end. Arrays are used in place, so the image must start on
+// an 8-byte boundary and outlive them.
+//
+// The checksum only catches accidental damage; anyone can compute it for an
+// image they made up. Every array that holds indexes is therefore checked
+// element by element while it is hashed, so an image that indexes past an
+// array is rejected instead of being run.
+class ImageReader {
+private:
+    static const size_t CHECKSUM_BYTES = 2 * sizeof(uint64_t);   // Trailer after the sections
+    static const size_t PIECE_ELEMENTS = 2048;   // Elements checked per hashed piece, a multiple of 32
+
+    const char* base;             // Start of the image
+    size_t size;                  // Bytes of sections, before the checksum
+    size_t offset;                // Next unread byte
+    bool failed;                  // Set by the first read past the end
+    FingerprintHasher checksum;   // Hash of the sections read so far
+
+    // Hashes and skips the next section of the given size
+    void consume(size_t bytes) {
+        checksum.addPadded(base + offset, bytes);
+        skip(bytes);
+    }
+
+    // Skips a section of the given size and its padding
+    void skip(size_t bytes) {
+        offset = min(size, offset + bytes + (8 - bytes % 8) % 8);
+    }
+
+public:
+    ImageReader(const char* data, size_t size) {
+        base = data;
+        offset = 0;
+        failed = size < CHECKSUM_BYTES || reinterpret_cast<uintptr_t>(data) % 8 != 0;
+        this->size = failed ? 0 : size - CHECKSUM_BYTES;
+    }
+
+    // Returns true if every section was read and the checksum matches them,
+    // so the image is exactly as written. Hashing the sections as they are
+    // read, with the element checks, is the only pass over the whole image.
+    bool verifyChecksum() const {
+        uint64_t parts[2];
+        checksum.digest(parts);
+        return !failed && offset == size && memcmp(parts, base + size, CHECKSUM_BYTES) == 0;
+    }
+
+    // Copies count elements into a vector or string; returns false if the image is too short
+    template <typename Container>
+    bool readArray(Container& out, uint64_t count) {
+        typedef typename Container::value_type T;
+        if (failed || count > (size - offset) / sizeof(T)) {
+            failed = true;
+            return false;
+        }
+        size_t bytes = (size_t)count * sizeof(T);
+        out.resize((size_t)count);
+        if (bytes > 0) {
+            memcpy(out.data(), base + offset, bytes);
+        }
+        consume(bytes);
+        return true;
+    }
+
+    // Points an array at count elements in place; returns false if the image is too short
+    template <typename T>
+    bool readArray(ImageArray<T>& out, uint64_t count) {
+        return readArray(out, count, [](const T&, size_t) { return true; });
+    }
+
+    // Points an array at count elements in place, calling check(element,
+    // index) on every element in the same pass that hashes it; returns false
+    // if the image is too short or any check fails
+    template <typename T, typename Check>
+    bool readArray(ImageArray<T>& out, uint64_t count, Check check) {
+        static_assert(alignof(T) <= 8, "Image sections are only 8-byte aligned");
+        if (failed || count > (size - offset) / sizeof(T)) {
+            failed = true;
+            return false;
+        }
+        const T* elements = reinterpret_cast<const T*>(base + offset);
+        size_t checked = 0;
+        bool valid = true;
+        checksum.addPadded(base + offset, (size_t)count * sizeof(T), PIECE_ELEMENTS * sizeof(T), [&](size_t hashed) {
+            bool pieceValid = true;
+            for (size_t end = hashed / sizeof(T); checked < end; checked++) {
+                pieceValid &= check(elements[checked], checked);   // No branch, so simple checks vectorize
+            }
+            valid &= pieceValid;
+        });
+        skip((size_t)count * sizeof(T));
+        out.refer(elements, (size_t)count);
+        failed = !valid;
+        return valid;
+    }
+
+    // Reads a single value; returns false if the image is too short
+    template <typename T>
+    bool readValue(T& value) {
+        if (failed || sizeof(T) > size - offset) {
+            failed = true;
+            return false;
+        }
+        memcpy(&value, base + offset, sizeof(T));
+        consume(sizeof(T));
+        return true;
+    }
+
+    // Returns true if every read succeeded
+    bool ok() const {
+        return !failed;
+    }
+};
+
+// Registry that interns chip IDs into handles. IDs of the form type letter
+// plus number (I1, A100, O50) resolve through a direct-indexed table per type
+// letter; any other ID falls back to a hash index. The ID strings themselves
+// are kept for printing. A circuit image stores the IDs with sorted lists of
+// them instead of the tables, and a loaded registry searches those in place.
+class ChipRegistry {
+private:
+    static const uint32_t MIN_DIRECT_LIMIT = 1024;  // Numbers always allowed in the direct tables
+
+    // An ID of the form type letter plus number, as listed in a circuit image
+    struct NumberedId {
+        uint32_t slot;       // Type letter, 0 for A
+        uint32_t number;     // Number after the letter
+        ChipHandle handle;   // Latest declaration of the ID
+    };
+
+    vector<ChipHandle> byNumber[26];             // Direct tables, one per type letter A-Z
+    uint32_t directLimit;                        // Largest number (exclusive) kept in a direct table
+    unordered_map<string, ChipHandle> byName;    // Fallback index for IDs not of the form letter+number
+    ImageArray<char> nameChars;                  // All interned IDs, back to back (printing only)
+    ImageArray<uint64_t> nameOffsets;            // Start of each handle's ID in nameChars, plus an end marker
+    ImageArray<NumberedId> numberedIds;          // Loaded letter+number IDs, sorted by letter and number
+    ImageArray<ChipHandle> namedIds;             // Loaded handles of the other IDs, sorted by ID
+    bool fromImage;                              // True if lookups go through the sorted lists
+
+    // Splits an ID into its type slot and number; returns false if the ID is
+    // not a capital letter followed by a canonical decimal number
+    static bool parseId(string_view id, int& slot, uint32_t& number);
+
+    // Splits an ID like parseId(), but only if its number fits the direct tables
+    bool splitId(string_view id, int& slot, uint32_t& number) const;
+
+    // Points the lookup tables at a handle for its ID
+    void index(string_view id, ChipHandle handle);
+
+    // Lists the IDs in the tables in the sorted form of a circuit image
+    void sortIds(vector<NumberedId>& numbered, vector<ChipHandle>& named) const;
+
+    // Returns the direct table limit for a circuit of the given number of
+    // chips. Each table then holds at most a few entries per chip, so sparse
+    // or very large ID numbers cost hash entries rather than empty table
+    // space; the small floor keeps the IDs of tiny netlists in the tables.
+    static uint32_t directLimitFor(uint64_t chips) {
+        return (uint32_t)min<uint64_t>(max<uint64_t>(MIN_DIRECT_LIMIT, 4 * chips), UINT32_MAX);
+    }
+
+public:
+    // Prepares the tables for the expected number of chips
+    explicit ChipRegistry(int expectedChips);
+
+    // Interns a newly declared chip ID and returns its handle
+    ChipHandle intern(string_view id);
+
+    // Returns the handle for the given ID, or NO_CHIP if it was never declared
+    ChipHandle find(string_view id) const;
+
+    // Returns the ID of a chip for printing
+    string_view nameOf(ChipHandle handle) const;
+
+    // Writes the interned IDs and their sorted lists to a circuit image
+    void save(ImageWriter& image) const;
+
+    // Replaces the registry with the one stored in a circuit image, used in
+    // place; returns false if its sections do not fit together
+    bool load(ImageReader& image);
+
+    // Returns the number of interned chips
+    uint32_t size() const {
+        return (uint32_t)(nameOffsets.size() - 1);
+    }
+};
+
+ChipRegistry::ChipRegistry(int expectedChips) {
+    uint64_t expected = expectedChips > 0 ? (uint64_t)expectedChips : 0;
+    directLimit = directLimitFor(expected);
+    fromImage = false;
+    nameOffsets.edit().reserve(expected + 1);
+    nameOffsets.edit().push_back(0);
+}
+
+bool ChipRegistry::parseId(string_view id, int& slot, uint32_t& number) {
+    if (id.size() < 2 || id.size() > 10 || id[0] < 'A' || id[0] > 'Z') {
+        return false;
+    }
+    if (id[1] == '0' && id.size() > 2) {
+        return false;  // Leading zeros would make two spellings of one number
+    }
+    uint64_t value = 0;
+    for (size_t i = 1; i < id.size(); i++) {
+        if (id[i] < '0' || id[i] > '9') {
+            return false;
+        }
+        value = value * 10 + (uint64_t)(id[i] - '0');
+    }
+    slot = id[0] - 'A';
+    number = (uint32_t)value;   // At most nine digits
+    return true;
+}
+
+bool ChipRegistry::splitId(string_view id, int& slot, uint32_t& number) const {
+    return parseId(id, slot, number) && number < directLimit;
+}
+
+ChipHandle ChipRegistry::intern(string_view id) {
+    if (fromImage) {
+        // The sorted lists of an image cannot take new IDs, so move every
+        // loaded ID into the tables first
+        fromImage = false;
+        directLimit = directLimitFor(size());
+        for (ChipHandle handle = 0; handle < size(); handle++) {
+            index(nameOf(handle), handle);
+        }
+        numberedIds.rebuild();
+        namedIds.rebuild();
+    }
+    ChipHandle handle = size();
+    vector<char>& chars = nameChars.edit();
+    chars.insert(chars.end(), id.begin(), id.end());
+    nameOffsets.edit().push_back(chars.size());
+    index(id, handle);
+    return handle;
+}
+
+void ChipRegistry::index(string_view id, ChipHandle handle) {
+    // A repeated ID refers to the latest declaration
+    int slot;
+    uint32_t number;
+    if (splitId(id, slot, number)) {
+        vector<ChipHandle>& table = byNumber[slot];
+        if (table.size() <= number) {
+            table.resize((size_t)number + 1, NO_CHIP);
+        }
+        table[number] = handle;
+    } else {
+        byName[string(id)] = handle;
+    }
+}
+
+ChipHandle ChipRegistry::find(string_view id) const {
+    int slot;
+    uint32_t number;
+    if (fromImage) {
+        if (parseId(id, slot, number)) {
+            auto it = lower_bound(numberedIds.begin(), numberedIds.end(), make_pair((uint32_t)slot, number),
+                                  [](const NumberedId& entry, const pair<uint32_t, uint32_t>& key) {
+                                      return entry.slot != key.first ? entry.slot < key.first : entry.number < key.second;
+                                  });
+            return it != numberedIds.end() && it->slot == (uint32_t)slot && it->number == number ? it->handle : NO_CHIP;
+        }
+        auto it = lower_bound(namedIds.begin(), namedIds.end(), id,
+                              [this](ChipHandle handle, string_view key) { return nameOf(handle) < key; });
+        return it != namedIds.end() && nameOf(*it) == id ? *it : NO_CHIP;
+    }
+    if (splitId(id, slot, number)) {
+        const vector<ChipHandle>& table = byNumber[slot];
+        return number < table.size() ? table[number] : NO_CHIP;
+    }
+    auto it = byName.find(string(id));
+    return it == byName.end() ? NO_CHIP : it->second;
+}
+
+string_view ChipRegistry::nameOf(ChipHandle handle) const {
+    uint64_t start = nameOffsets[handle];
+    return string_view(nameChars.data() + start, (size_t)(nameOffsets[handle + 1] - start));
+}
+
+void ChipRegistry::sortIds(vector<NumberedId>& numbered, vector<ChipHandle>& named) const {
+    // The tables come out in order; only IDs past the direct limit, which
+    // the hash index holds with the IDs of other forms, need a sort
+    for (uint32_t slot = 0; slot < 26; slot++) {
+        const vector<ChipHandle>& table = byNumber[slot];
+        for (uint32_t number = 0; number < table.size(); number++) {
+            if (table[number] != NO_CHIP) {
+                NumberedId entry = { slot, number, table[number] };
+                numbered.push_back(entry);
+            }
+        }
+    }
+    size_t fromTables = numbered.size();
+    for (const auto& item : byName) {
+        int slot;
+        uint32_t number;
+        if (parseId(item.first, slot, number)) {
+            NumberedId entry = { (uint32_t)slot, number, item.second };
+            numbered.push_back(entry);
+        } else {
+            named.push_back(item.second);
+        }
+    }
+    if (numbered.size() > fromTables) {
+        sort(numbered.begin(), numbered.end(), [](const NumberedId& a, const NumberedId& b) {
+            return a.slot != b.slot ? a.slot < b.slot : a.number < b.number;
+        });
+    }
+    sort(named.begin(), named.end(), [this](ChipHandle a, ChipHandle b) { return nameOf(a) < nameOf(b); });
+}
+
+void ChipRegistry::save(ImageWriter& image) const {
+    image.writeValue((uint64_t)nameOffsets.size());
+    image.writeArray(nameOffsets.data(), nameOffsets.size());
+    image.writeValue((uint64_t)nameChars.size());
+    image.writeArray(nameChars.data(), nameChars.size());
+
+    // The lookup tables are sized by ID numbers, so the image gets sorted
+    // lists instead, whose size follows the chip count
+    vector<NumberedId> numbered;
+    vector<ChipHandle> named;
+    if (!fromImage) {
+        sortIds(numbered, named);
+    }
+    const NumberedId* numberedData = fromImage ? numberedIds.data() : numbered.data();
+    const ChipHandle* namedData = fromImage ? namedIds.data() : named.data();
+    size_t numberedCount = fromImage ? numberedIds.size() : numbered.size();
+    size_t namedCount = fromImage ? namedIds.size() : named.size();
+    image.writeValue((uint64_t)numberedCount);
+    image.writeArray(numberedData, numberedCount);
+    image.writeValue((uint64_t)namedCount);
+    image.writeArray(namedData, namedCount);
+}
+
+bool ChipRegistry::load(ImageReader& image) {
+    // Name offsets only grow, from 0 to the end of the names; handles name
+    // chips; numbered IDs are in strictly ascending order, which the binary
+    // search in find() relies on
+    uint64_t count;
+    if (!image.readValue(count) || count == 0 || count > NO_CHIP) {
+        return false;
+    }
+    ChipHandle chips = (ChipHandle)(count - 1);
+    uint64_t previousOffset = 0;
+    auto ascendingOffset = [&](uint64_t offset, size_t) {
+        bool valid = offset >= previousOffset;
+        previousOffset = offset;
+        return valid;
+    };
+    uint64_t previousKey = 0;   // Slot and number of the previous ID, plus one so the first passes
+    auto validNumberedId = [&](const NumberedId& id, size_t) {
+        uint64_t key = ((uint64_t)id.slot << 32 | id.number) + 1;
+        bool valid = (id.slot < 26) & (id.handle < chips) & (key > previousKey);
+        previousKey = key;
+        return valid;
+    };
+    auto validHandle = [chips](ChipHandle handle, size_t) { return handle < chips; };
+    if (!image.readArray(nameOffsets, count, ascendingOffset) || nameOffsets[0] != 0 ||
+        !image.readValue(count) || count != nameOffsets.back() || !image.readArray(nameChars, count) ||
+        !image.readValue(count) || !image.readArray(numberedIds, count, validNumberedId) ||
+        !image.readValue(count) || !image.readArray(namedIds, count, validHandle) ||
+        numberedIds.size() + namedIds.size() > chips) {
+        return false;
+    }
+    for (vector<ChipHandle>& table : byNumber) {
+        vector<ChipHandle>().swap(table);
+    }
+    byName.clear();
+    fromImage = true;
+    return true;
+}
+
+// Buffered writer for everything the simulator prints. Text and numbers are
+// formatted straight into one reusable block, with no allocation per value,
+// and each full block goes out in a single write. Nothing reaches the output
+// before the block fills, flush() is called, or the writer is destroyed.
+class OutputWriter {
+private:
+    static const size_t BLOCK_SIZE = (size_t)1 << 20;   // Bytes buffered per write
+
+    vector<char> block;   // Pending output
+    size_t used;          // Bytes of block in use
+    FILE* stream;         // Destination
+
+    // Makes room for n more bytes, writing out the block if needed
+    void reserve(size_t n) {
+        if (used + n > block.size()) {
+            flush();
+        }
+    }
+
+public:
+    explicit OutputWriter(FILE* stream);
+    ~OutputWriter();
+
+    // Writes out everything buffered so far
+    void flush();
+
+    // Writes out everything buffered so far and returns the error stream, so
+    // a warning or error never overtakes the output printed before it
+    ostream& error() {
+        flush();
+        return cerr;
+    }
+
+    OutputWriter& operator<<(string_view text);
+    OutputWriter& operator<<(const char* text) {
+        return *this << string_view(text);
+    }
+    OutputWriter& operator<<(char c) {
+        reserve(1);
+        block[used++] = c;
+        return *this;
+    }
+
+    // Formats like an ostream with default settings (six significant digits, as %g)
+    OutputWriter& operator<<(double value);
+
+    // Formats an integer in decimal
+    template <typename Integer, typename = typename enable_if<is_integral<Integer>::value>::type>
+    OutputWriter& operator<<(Integer value) {
+        reserve(24);
+        used = (size_t)(to_chars(block.data() + used, block.data() + block.size(), value).ptr - block.data());
+        return *this;
+    }
+};
+
+OutputWriter::OutputWriter(FILE* stream) : block(BLOCK_SIZE) {
+    used = 0;
+    this->stream = stream;
+}
+
+OutputWriter::~OutputWriter() {
+    flush();
+}
+
+void OutputWriter::flush() {
+    const char* p = block.data();
+    size_t left = used;
+#ifdef CHIPSIM_POSIX_IO
+    int fd = fileno(stream);
+    while (left > 0) {
+        ssize_t wrote = write(fd, p, left);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;   // Output closed; drop the block like an ostream in a failed state
+        }
+        p += wrote;
+        left -= (size_t)wrote;
+    }
+#else
+    fwrite(p, 1, left, stream);
+    fflush(stream);
+#endif
+    used = 0;
+}
+
+OutputWriter& OutputWriter::operator<<(string_view text) {
+    if (text.size() > block.size()) {
+        flush();
+        block.resize(text.size());   // Oversized text gets a block of its own
+    }
+    reserve(text.size());
+    memcpy(block.data() + used, text.data(), text.size());
+    used += text.size();
+    return *this;
+}
+
+OutputWriter& OutputWriter::operator<<(double value) {
+    reserve(32);
+    used = (size_t)(to_chars(block.data() + used, block.data() + block.size(), value, chars_format::general, 6).ptr - block.data());
+    return *this;
+}
+
+// Operation codes of the chips and of the compiled evaluation tape
+enum OpCode : uint32_t {
+    OP_ADD,     // Addition chip
+    OP_SUB,     // Subtraction chip
+    OP_MUL,     // Multiplication chip
+    OP_DIV,     // Division chip (division by zero yields zero)
+    OP_NEG,     // Negation chip
+    OP_OUT,     // Output chip, copies its input
+    OP_NONE     // Chips with no operation (input chips and unknown types)
+};
+
+// Maps a chip type letter to its tape operation
+OpCode opFromType(char type) {
+    switch (type) {
+        case 'A': return OP_ADD;
+        case 'S': return OP_SUB;
+        case 'M': return OP_MUL;
+        case 'D': return OP_DIV;
+        case 'N': return OP_NEG;
+        case 'O': return OP_OUT;
+        default:  return OP_NONE;
+    }
+}
+
+// Operation functions indexed by OpCode, the one definition of what each
+// chip computes. The demand engine applies a chip's operation with a single
+// indexed call whatever its type, so a new chip type adds a function and an
+// entry here rather than another branch there.
+typedef double (*OpFunction)(double a, double b);
+
+inline double opAdd(double a, double b) { return a + b; }
+inline double opSub(double a, double b) { return a - b; }
+inline double opMul(double a, double b) { return a * b; }
+inline double opDiv(double a, double b) { return b != 0 ? a / b : 0; }   // Division by zero yields zero
+inline double opNeg(double a, double) { return 0 - a; }                 // 0 - a keeps a zero input at +0
+inline double opOut(double a, double) { return a; }
+inline double opNone(double, double) { return 0; }                      // A chip with no operation reads as zero
+
+const OpFunction OP_FUNCTIONS[OP_NONE + 1] = { opAdd, opSub, opMul, opDiv, opNeg, opOut, opNone };
+
+// Applies an operation to its two input values. The tape loops, the bytecode
+// handlers and the scalar lane kernels go through it, passing a constant op
+// where they handle one operation, so the switch folds into the inlined
+// function. The vector lane kernels and the native code generator spell each
+// operation out in their own instructions and need a case for a new type.
+inline double evalOp(uint32_t op, double a, double b) {
+    switch (op) {
+        case OP_ADD: return opAdd(a, b);
+        case OP_SUB: return opSub(a, b);
+        case OP_MUL: return opMul(a, b);
+        case OP_DIV: return opDiv(a, b);
+        case OP_NEG: return opNeg(a, b);
+        case OP_OUT: return opOut(a, b);
+        default:     return opNone(a, b);
+    }
+}
+
+class ThreadPool;
+
+// All chips of a circuit, stored in arrays indexed by chip handle: one packed
+// 16-byte node per chip with its type and links, and dense value arrays
+// beside it. Links between chips are 32-bit handles rather than pointers, so
+// the whole circuit lives in a handful of contiguous arrays that are
+// allocated together and freed together.
+//
+// Connections are made in bulk. Each A command becomes a (source,
+// destination, slot) tuple, where the slot counts the connections made into
+// the destination before it; connectAll() then groups a batch of tuples by
+// destination and sets every input link in one parallel pass. A binary chip
+// takes its first connection as input 1 and its last as input 2, and a
+// negation or output chip takes its last connection, exactly as if the
+// commands had been applied one at a time.
+class Circuit {
+public:
+    struct Connection {
+        ChipHandle from;   // Chip whose output is connected
+        ChipHandle to;     // Chip receiving the connection
+        uint32_t slot;     // Connections made into `to` before this one
+    };
+
+    // A destination chip whose connections in a batch looked wrong
+    struct ConnectionIssue {
+        ChipHandle chip;   // Destination chip
+        bool duplicate;    // The same source was connected to it more than once
+        bool overArity;    // It received more connections than it has inputs
+    };
+
+private:
+    // The links of one chip, packed so that evaluating a chip reads a single
+    // 16-byte record; values live in the separate arrays below
+    struct ChipNode {
+        char type;            // Type of the chip (A: Addition, S: Subtraction, etc.)
+        uint8_t op;           // OpCode of the type, which indexes OP_FUNCTIONS
+        char unused[2];       // Padding, kept zero so saved images are reproducible
+        ChipHandle input1;    // First input chip (NO_CHIP if unset)
+        ChipHandle input2;    // Second input chip (NO_CHIP if unset or unused)
+        ChipHandle output;    // Chip this chip was last connected to (NO_CHIP for output chips)
+    };
+    static_assert(sizeof(ChipNode) == 16, "ChipNode must stay packed");
+
+    ImageArray<ChipNode> nodes;     // Type and links of each chip
+    vector<double> inputValue;      // Input value for input chips (used in I type chips); zero past its end
+    vector<double> result;          // Computed result for each chip; allocated by the first compute()
+    vector<uint32_t> evalStamp;     // Evaluation epoch in which each chip's result was last computed
+    uint32_t epoch;                 // Current evaluation epoch; bumping it invalidates every result at once
+    vector<ChipHandle> workStack;   // Explicit stack for compute(), reused across queries
+    vector<uint32_t> connectionCount;  // Connections made into each chip so far; extended on demand
+
+    // Applies a chip's operation to the already computed results of its inputs
+    void computeChip(ChipHandle chip, const ChipRegistry& registry, OutputWriter& writer);
+
+    // Computes the chips on the work stack and their inputs in a new epoch
+    void computeStack(const ChipRegistry& registry, OutputWriter& writer);
+
+    // Returns how many inputs a chip of the given type reads
+    static uint32_t arityOf(char type);
+
+    // Extends connectionCount to the chips declared or loaded since it was
+    // last used
+    void countConnections();
+
+    // Sets the input links of one chip from its connections in a batch, given
+    // in slot order; returns the issue flags for the chip
+    ConnectionIssue connectChip(ChipHandle chip, const Connection* edges, const uint32_t* order, size_t count);
+
+public:
+    // Reserves storage for the expected number of chips
+    explicit Circuit(int expectedChips);
+
+    // Appends a chip of the given type and returns its handle
+    ChipHandle addChip(char type);
+
+    // Returns the tuple for connecting the output of one chip to an input of
+    // another (the A command); the link is made by connectAll()
+    Connection makeConnection(ChipHandle from, ChipHandle to) {
+        if (connectionCount.size() != nodes.size()) {
+            countConnections();
+        }
+        Connection edge = { from, to, connectionCount[to]++ };
+        return edge;
+    }
+
+    // Applies a batch of connections, in the order they were made, using the
+    // pool for large batches; destinations with suspicious connections are
+    // appended to issues in handle order
+    void connectAll(const vector<Connection>& edges, ThreadPool& pool, vector<ConnectionIssue>& issues);
+
+    // Performs the operation of a chip, computing its inputs first; every chip
+    // is computed at most once per call and no recursion is involved (the
+    // registry is only used for error messages)
+    void compute(ChipHandle chip, const ChipRegistry& registry, OutputWriter& writer);
+
+    // Computes several chips in one sweep; a chip shared by their inputs is
+    // computed once for all of them
+    void compute(const vector<ChipHandle>& chips, const ChipRegistry& registry, OutputWriter& writer);
+
+    // Displays a chip's details (inputs, outputs, ID)
+    void display(ChipHandle chip, const ChipRegistry& registry, OutputWriter& writer) const;
+
+    // Sets the input value for input chips
+    void setInputValue(ChipHandle chip, double value) {
+        if (chip >= inputValue.size()) {
+            inputValue.resize(nodes.size(), 0);
+        }
+        inputValue[chip] = value;
+    }
+
+    // Returns the chip's type (A, S, M, D, etc.)
+    char getChipType(ChipHandle chip) const {
+        return nodes[chip].type;
+    }
+
+    // Returns the first input chip (for internal logic and testing)
+    ChipHandle getInput1(ChipHandle chip) const {
+        return nodes[chip].input1;
+    }
+
+    // Returns the second input chip
+    ChipHandle getInput2(ChipHandle chip) const {
+        return nodes[chip].input2;
+    }
+
+    // Returns the value last set on an input chip
+    double getInputValue(ChipHandle chip) const {
+        return chip < inputValue.size() ? inputValue[chip] : 0;
+    }
+
+    // Returns the result computed by a chip
+    double getResult(ChipHandle chip) const {
+        return result[chip];
+    }
+
+    // Returns the number of chips in the circuit
+    uint32_t size() const {
+        return (uint32_t)nodes.size();
+    }
+
+    // Writes the chip types and connections to a circuit image
+    void save(ImageWriter& image) const;
+
+    // Replaces the circuit with the one stored in a circuit image, used in
+    // place; input values start at zero. Returns false if the image is too short.
+    bool load(ImageReader& image);
+};
+
+Circuit::Circuit(int expectedChips) {
+    size_t expected = expectedChips > 0 ? (size_t)expectedChips : 0;
+    nodes.edit().reserve(expected);
+    inputValue.reserve(expected);
+    connectionCount.reserve(expected);
+    epoch = 0;
+}
+
+ChipHandle Circuit::addChip(char type) {
+    ChipHandle handle = size();
+    ChipNode node;
+    memset(&node, 0, sizeof(node));
+    node.type = type;            // Set chip type (e.g., A, S, M)
+    node.op = (uint8_t)opFromType(type);
+    node.input1 = NO_CHIP;       // Inputs are unset until connected
+    node.input2 = NO_CHIP;
+    node.output = NO_CHIP;       // Output is initially unset (set later)
+    nodes.edit().push_back(node);
+    return handle;
+}
+
+uint32_t Circuit::arityOf(char type) {
+    if (type == 'N' || type == 'O') {
+        return 1;   // Negation/output chips take only one input
+    }
+    if (type == 'A' || type == 'S' || type == 'M' || type == 'D') {
+        return 2;
+    }
+    return 0;       // Input chips and unknown chips take no connections
+}
+
+Circuit::ConnectionIssue Circuit::connectChip(ChipHandle chip, const Connection* edges, const uint32_t* order,
+                                              size_t count) {
+    ConnectionIssue issue = { chip, false, false };
+    ChipNode& node = nodes.edit()[chip];
+    uint32_t arity = arityOf(node.type);
+    const Connection& first = edges[order[0]];
+    const Connection& last = edges[order[count - 1]];
+    ChipHandle earlier[2] = { NO_CHIP, NO_CHIP };   // Inputs left by earlier batches
+    if (arity > 0 && first.slot > 0) {
+        earlier[0] = node.input1;
+    }
+    if (arity == 2 && first.slot > 1) {
+        earlier[1] = node.input2;
+    }
+    if (arity == 1) {
+        node.input1 = last.from;    // Each connection replaces the previous one
+    } else if (arity == 2) {
+        if (first.slot == 0) {
+            node.input1 = first.from;   // The first connection ever made is input 1
+        }
+        if (last.slot > 0) {
+            node.input2 = last.from;    // Every later one replaces input 2
+        }
+    }
+    issue.overArity = last.slot >= arity;
+
+    // A chip rarely has more than a couple of connections, so compare them
+    // pairwise and only sort when there are many
+    if (count <= 16) {
+        for (size_t i = 0; i < count && !issue.duplicate; i++) {
+            for (size_t j = i + 1; j < count; j++) {
+                if (edges[order[i]].from == edges[order[j]].from) {
+                    issue.duplicate = true;
+                    break;
+                }
+            }
+        }
+    } else {
+        vector<ChipHandle> sources(count);
+        for (size_t i = 0; i < count; i++) {
+            sources[i] = edges[order[i]].from;
+        }
+        sort(sources.begin(), sources.end());
+        issue.duplicate = adjacent_find(sources.begin(), sources.end()) != sources.end();
+    }
+    for (size_t i = 0; i < count && !issue.duplicate; i++) {
+        ChipHandle from = edges[order[i]].from;
+        issue.duplicate = from == earlier[0] || from == earlier[1];
+    }
+    return issue;
+}
+
+void Circuit::save(ImageWriter& image) const {
+    image.writeValue((uint64_t)nodes.size());
+    image.writeArray(nodes.data(), nodes.size());
+}
+
+bool Circuit::load(ImageReader& image) {
+    // Every link names a chip of the image, and the op matches the type
+    uint64_t count;
+    if (!image.readValue(count) || count >= NO_CHIP) {
+        return false;
+    }
+    // A link plus one wraps NO_CHIP around to 0, so one comparison accepts it and every chip
+    uint8_t opOfType[256];
+    for (int type = 0; type < 256; type++) {
+        opOfType[type] = (uint8_t)opFromType((char)type);
+    }
+    auto validNode = [&](const ChipNode& node, size_t) {
+        return ((uint64_t)(uint32_t)(node.input1 + 1) <= count) & ((uint64_t)(uint32_t)(node.input2 + 1) <= count) &
+               ((uint64_t)(uint32_t)(node.output + 1) <= count) & (node.op == opOfType[(unsigned char)node.type]);
+    };
+    if (!image.readArray(nodes, count, validNode)) {
+        return false;
+    }
+
+    // Everything sized by the chip count is derived when first needed, so
+    // loading does not visit the nodes
+    inputValue.clear();
+    result.clear();
+    evalStamp.clear();
+    connectionCount.clear();
+    epoch = 0;
+    return true;
+}
+
+void Circuit::countConnections() {
+    // Enough for later connections to land on the same inputs as before
+    for (size_t chip = connectionCount.size(); chip < nodes.size(); chip++) {
+        connectionCount.push_back((nodes[chip].input1 != NO_CHIP) + (nodes[chip].input2 != NO_CHIP));
+    }
+}
+
+void Circuit::compute(ChipHandle chip, const ChipRegistry& registry, OutputWriter& writer) {
+    workStack.clear();
+    workStack.push_back(chip);
+    computeStack(registry, writer);
+}
+
+void Circuit::compute(const vector<ChipHandle>& chips, const ChipRegistry& registry, OutputWriter& writer) {
+    workStack.clear();
+    for (size_t i = chips.size(); i-- > 0;) {
+        workStack.push_back(chips[i]);   // Pushed in reverse so the first chip is computed first
+    }
+    computeStack(registry, writer);
+}
+
+void Circuit::computeStack(const ChipRegistry& registry, OutputWriter& writer) {
+    // Results and stamps are only needed here, so circuits evaluated by the
+    // compiled engines never allocate them
+    if (result.size() != nodes.size()) {
+        result.resize(nodes.size(), 0);
+        evalStamp.resize(nodes.size(), 0);
+    }
+
+    // Start a new epoch so every stamp from earlier queries is stale; each
+    // epoch uses two stamp values, one for "inputs pushed" and one for "computed"
+    epoch += 2;
+    if (epoch < 2) {
+        fill(evalStamp.begin(), evalStamp.end(), 0);  // Stamps wrapped around; clear them once
+        epoch = 2;
+    }
+    const uint32_t expanded = epoch;
+    const uint32_t computed = epoch + 1;
+
+    // Post-order walk with an explicit stack, so circuit depth is bounded by
+    // heap memory rather than the native call stack. A chip is computed the
+    // second time it reaches the top of the stack, after its inputs.
+    while (!workStack.empty()) {
+        ChipHandle top = workStack.back();
+        uint32_t stamp = evalStamp[top];
+        if (stamp == computed) {
+            workStack.pop_back();    // Already computed for this query through another path
+        }
+        else if (stamp != expanded) {
+            evalStamp[top] = expanded;
+            const ChipNode& node = nodes[top];
+            if (node.type != 'I') {
+                // Push input2 first so input1 is computed first
+                ChipHandle in1 = node.input1;
+                ChipHandle in2 = node.input2;
+                if (in2 != NO_CHIP && evalStamp[in2] < expanded) workStack.push_back(in2);
+                if (in1 != NO_CHIP && evalStamp[in1] < expanded) workStack.push_back(in1);
+            }
+        }
+        else {
+            workStack.pop_back();
+            computeChip(top, registry, writer);
+            evalStamp[top] = computed;
+        }
+    }
+}
+
+// Perform the operation based on the chip type, once its inputs are computed
+void Circuit::computeChip(ChipHandle chip, const ChipRegistry& registry, OutputWriter& writer) {
+    const ChipNode& node = nodes[chip];
+
+    // If it's an input chip, directly return its value
+    if (node.type == 'I') {
+        result[chip] = getInputValue(chip);  // Input chip simply passes its value
+        return;
+    }
+
+    ChipHandle in1 = node.input1;
+    ChipHandle in2 = node.input2;
+
+    // Unconnected inputs read as zero
+    double a = in1 != NO_CHIP ? result[in1] : 0;
+    double b = in2 != NO_CHIP ? result[in2] : 0;
+
+    // Perform the chip's operation through the op table; only the error
+    // message for a division by zero needs to know the type
+    if (node.op == OP_DIV && b == 0) {
+        writer << "Error: Division by zero in chip " << registry.nameOf(chip) << '\n';
+    }
+    result[chip] = OP_FUNCTIONS[node.op](a, b);
+}
+
+// Displays the chip's connections and output
+void Circuit::display(ChipHandle chip, const ChipRegistry& registry, OutputWriter& writer) const {
+    const string_view none = "None";
+    const ChipNode& node = nodes[chip];
+    ChipHandle in1 = node.input1;
+    ChipHandle in2 = node.input2;
+    ChipHandle out = node.output;
+    if (node.type == 'I') {  // Display for input chip
+        writer << registry.nameOf(chip) << ", Output = " << (out != NO_CHIP ? registry.nameOf(out) : none) << '\n';
+    }
+    else if (node.type == 'O') {  // Display for output chip
+        writer << registry.nameOf(chip) << ", Input 1 = " << (in1 != NO_CHIP ? registry.nameOf(in1) : none) << '\n';
+    }
+    else {  // Display for other chips with two inputs and an output
+        writer << registry.nameOf(chip) << ", Input 1 = " << (in1 != NO_CHIP ? registry.nameOf(in1) : none);
+        writer << ", Input 2 = " << (in2 != NO_CHIP ? registry.nameOf(in2) : none);
+        writer << ", Output = " << (out != NO_CHIP ? registry.nameOf(out) : none);
+        writer << '\n';
+    }
+}
+
+// One record of the evaluation tape: values[dst] = op(values[src1], values[src2])
+struct TapeEntry {
+    uint32_t op;      // OpCode of the chip
+    uint32_t src1;    // Value slot of the first input
+    uint32_t src2;    // Value slot of the second input
+    uint32_t dst;     // Value slot written by this entry
+};
+
+// Fixed set of worker threads that run parallel loops for the evaluation
+// engines. The calling thread takes part in every loop, so a pool created for
+// n threads starts n - 1 workers. They are started by the first loop that
+// splits its work, so a run that never has enough work to split starts none.
+class ThreadPool {
+private:
+    unsigned threads;                              // Total thread count, including the caller
+    vector<thread> workers;                        // Worker threads, empty until the first split loop
+    mutex lock;                                    // Guards the fields below
+    condition_variable wake;                       // Signals workers that a loop started or the pool stops
+    condition_variable finished;                   // Signals the caller that workers left the loop
+    const function<void(size_t, size_t)>* body;    // Body of the current loop, called per chunk
+    size_t count;                                  // Iterations in the current loop
+    size_t chunk;                                  // Iterations claimed at a time
+    atomic<size_t> next;                           // First unclaimed iteration
+    uint64_t generation;                           // Number of loops started so far
+    unsigned busy;                                 // Workers still inside the current loop
+    bool stopping;                                 // Set when the pool is destroyed
+
+    // Claims and runs chunks of the current loop until none are left
+    void runChunks();
+
+    // Main function of each worker thread
+    void workerLoop();
+
+public:
+    // Creates a pool of the given total thread count; no worker starts yet
+    explicit ThreadPool(unsigned threads);
+
+    // Stops and joins the workers
+    ~ThreadPool();
+
+    // Returns the total thread count, including the caller
+    unsigned size() const {
+        return threads;
+    }
+
+    // Calls body(begin, end) over [0, count) in chunks across all threads and
+    // returns once every chunk has finished
+    void parallelFor(size_t count, size_t chunk, const function<void(size_t, size_t)>& body);
+};
+
+ThreadPool::ThreadPool(unsigned threads) : next(0) {
+    this->threads = max(1u, threads);
+    body = nullptr;
+    count = 0;
+    chunk = 1;
+    generation = 0;
+    busy = 0;
+    stopping = false;
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::runChunks() {
+    for (;;) {
+        size_t begin = next.fetch_add(chunk);
+        if (begin >= count) {
+            return;
+        }
+        (*body)(begin, min(count, begin + chunk));
+    }
+}
+
+void ThreadPool::workerLoop() {
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            unique_lock<mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+        runChunks();
+        {
+            lock_guard<mutex> guard(lock);
+            busy--;
+        }
+        finished.notify_one();
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, size_t chunk, const function<void(size_t, size_t)>& body) {
+    if (threads == 1 || count <= chunk) {
+        if (count > 0) {
+            body(0, count);
+        }
+        return;
+    }
+    for (unsigned i = (unsigned)workers.size() + 1; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+    {
+        lock_guard<mutex> guard(lock);
+        this->body = &body;
+        this->count = count;
+        this->chunk = max<size_t>(1, chunk);
+        next.store(0);
+        busy = (unsigned)workers.size();
+        generation++;
+    }
+    wake.notify_all();
+    runChunks();
+
+    // Every worker must leave the loop before the next one can start
+    unique_lock<mutex> guard(lock);
+    finished.wait(guard, [&] { return busy == 0; });
+}
+
+// Defined here rather than with the rest of Circuit because large batches run on the pool
+void Circuit::connectAll(const vector<Connection>& edges, ThreadPool& pool, vector<ConnectionIssue>& issues) {
+    // Batches smaller than this are grouped with a plain sort; the counting
+    // pass below touches arrays the size of the whole circuit
+    const size_t PARALLEL_GRAIN = 65536;
+    size_t numEdges = edges.size();
+    if (numEdges == 0) {
+        return;
+    }
+    const Connection* e = edges.data();
+    vector<uint32_t> order(numEdges);
+
+    // Nodes loaded from an image are copied out here, before any thread
+    // writes them; edit() then only reads the array on every thread
+    ChipNode* links = nodes.edit().data();
+
+    if (numEdges < PARALLEL_GRAIN) {
+        for (uint32_t i = 0; i < numEdges; i++) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [e](uint32_t a, uint32_t b) {
+            return e[a].to != e[b].to ? e[a].to < e[b].to : e[a].slot < e[b].slot;
+        });
+        for (size_t begin = 0, end; begin < numEdges; begin = end) {
+            ChipHandle chip = e[order[begin]].to;
+            for (end = begin + 1; end < numEdges && e[order[end]].to == chip; end++) {
+            }
+            ConnectionIssue issue = connectChip(chip, e, order.data() + begin, end - begin);
+            if (issue.duplicate || issue.overArity) {
+                issues.push_back(issue);
+            }
+        }
+
+        // A chip's output link names the last chip it was connected to
+        for (size_t i = 0; i < numEdges; i++) {
+            if (arityOf(links[e[i].to].type) > 0) {
+                links[e[i].from].output = e[i].to;
+            }
+        }
+        return;
+    }
+
+    // Count the connections into each chip, turn the counts into offsets,
+    // then place every connection at its offset plus its slot within this
+    // batch. Slots are known up front, so placing a connection needs no
+    // atomics and each chip's connections come out in the order they were
+    // made. The same pass raises each source chip's last edge index with a
+    // compare-and-swap, since edges from one chip land in different chunks.
+    size_t numChips = size();
+    size_t edgeChunk = max<size_t>(PARALLEL_GRAIN / 4, numEdges / (pool.size() * 4));
+    size_t chipChunk = max<size_t>(PARALLEL_GRAIN / 4, numChips / (pool.size() * 4));
+    unique_ptr<atomic<uint32_t>[]> counts(new atomic<uint32_t>[numChips]());
+    unique_ptr<atomic<uint32_t>[]> lastOutput(new atomic<uint32_t>[numChips]());   // Last edge index + 1
+    function<void(size_t, size_t)> body = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            counts[e[i].to].fetch_add(1, memory_order_relaxed);
+        }
+    };
+    pool.parallelFor(numEdges, edgeChunk, body);
+    vector<uint32_t> start(numChips + 1);
+    start[0] = 0;
+    for (size_t chip = 0; chip < numChips; chip++) {
+        start[chip + 1] = start[chip] + counts[chip].load(memory_order_relaxed);
+    }
+    body = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            ChipHandle to = e[i].to;
+            uint32_t firstSlot = connectionCount[to] - counts[to].load(memory_order_relaxed);
+            order[start[to] + (e[i].slot - firstSlot)] = (uint32_t)i;
+            if (arityOf(links[to].type) > 0) {
+                atomic<uint32_t>& last = lastOutput[e[i].from];
+                uint32_t seen = last.load(memory_order_relaxed);
+                while (seen < i + 1 && !last.compare_exchange_weak(seen, (uint32_t)(i + 1), memory_order_relaxed)) {
+                }
+            }
+        }
+    };
+    pool.parallelFor(numEdges, edgeChunk, body);
+
+    // Every chip's links are now written by exactly one thread
+    vector<uint8_t> flags(numChips, 0);
+    body = [&](size_t begin, size_t end) {
+        for (size_t chip = begin; chip < end; chip++) {
+            if (start[chip + 1] > start[chip]) {
+                ConnectionIssue issue = connectChip((ChipHandle)chip, e, order.data() + start[chip],
+                                                    start[chip + 1] - start[chip]);
+                flags[chip] = (uint8_t)(issue.duplicate | (issue.overArity << 1));
+            }
+            uint32_t last = lastOutput[chip].load(memory_order_relaxed);
+            if (last != 0) {
+                links[chip].output = e[last - 1].to;   // A chip's output link names the last chip it was connected to
+            }
+        }
+    };
+    pool.parallelFor(numChips, chipChunk, body);
+    for (size_t chip = 0; chip < numChips; chip++) {
+        if (flags[chip] != 0) {
+            ConnectionIssue issue = { (ChipHandle)chip, (flags[chip] & 1) != 0, (flags[chip] & 2) != 0 };
+            issues.push_back(issue);
+        }
+    }
+}
+
+// Double-ended queue of ready tape positions owned by one worker. The owner
+// pushes and pops at the back, which keeps a chain of dependent entries hot
+// in its cache; idle workers steal the oldest entries from the front.
+class WorkDeque {
+private:
+    mutex lock;              // Guards items
+    deque<uint32_t> items;   // Ready tape positions
+
+public:
+    // Adds a ready position at the owner's end
+    void push(uint32_t pos) {
+        lock_guard<mutex> guard(lock);
+        items.push_back(pos);
+    }
+
+    // Takes the newest position; returns false if the deque is empty
+    bool pop(uint32_t& pos) {
+        lock_guard<mutex> guard(lock);
+        if (items.empty()) {
+            return false;
+        }
+        pos = items.back();
+        items.pop_back();
+        return true;
+    }
+
+    // Takes the oldest position for another worker; returns false if the deque is empty
+    bool steal(uint32_t& pos) {
+        lock_guard<mutex> guard(lock);
+        if (items.empty()) {
+            return false;
+        }
+        pos = items.front();
+        items.pop_front();
+        return true;
+    }
+};
+
+// x86-64 machine code that evaluates a run of tape entries in order. The
+// generated function takes the value array in rdi and turns each entry into
+// scalar SSE2 loads, one arithmetic instruction and a store, so a query runs
+// no interpreter at all. xmm0 always holds the value just stored, and an
+// entry that reads it skips the reload; the tape is in the post-order of the
+// compile walk, so about half the entries of a typical circuit read the entry
+// just before them.
+//
+// The code is written into an anonymous mapping that is made executable only
+// after it is complete. On other architectures, or if the mapping fails,
+// nothing is generated and callers fall back to the bytecode VM.
+class NativeCode {
+private:
+    void* code;     // Executable mapping holding the function, or null
+    size_t size;    // Size of the mapping in bytes
+
+    // Writes an SSE2 instruction with a [rdi + slot * 8] operand and advances out
+    static void emitMemory(uint8_t*& out, uint8_t prefix, uint8_t opcode, int reg, uint32_t slot);
+
+    // Writes an SSE2 instruction on two registers and advances out
+    static void emitRegisters(uint8_t*& out, uint8_t prefix, uint8_t opcode, int reg, int rm);
+
+public:
+    NativeCode();
+    ~NativeCode();
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    // Returns true if this build can generate machine code
+    static bool supported();
+
+    // Generates the code for count tape entries, the ones at the given
+    // positions of the tape or its first count if positions is null; returns
+    // false if code cannot be generated here
+    bool assemble(const TapeEntry* tape, const uint32_t* positions, size_t count);
+
+    // Returns true once code has been generated and run() may be called
+    bool ready() const {
+        return code != nullptr;
+    }
+
+    // Evaluates the assembled entries over a value array
+    void run(double* values) const {
+        reinterpret_cast<void (*)(double*)>(code)(values);
+    }
+};
+
+NativeCode::NativeCode() {
+    code = nullptr;
+    size = 0;
+}
+
+NativeCode::~NativeCode() {
+#ifdef CHIPSIM_X86_JIT
+    if (code != nullptr) {
+        munmap(code, size);
+    }
+#endif
+}
+
+bool NativeCode::supported() {
+#ifdef CHIPSIM_X86_JIT
+    return true;
+#else
+    return false;
+#endif
+}
+
+void NativeCode::emitMemory(uint8_t*& out, uint8_t prefix, uint8_t opcode, int reg, uint32_t slot) {
+    uint32_t offset = slot * 8;
+    out[0] = prefix;
+    out[1] = 0x0F;
+    out[2] = opcode;
+    out[3] = (uint8_t)(0x80 | reg << 3 | 7);   // mod 10, rm rdi: [rdi + disp32]
+    memcpy(out + 4, &offset, 4);               // x86 is little-endian, like the displacement
+    out += 8;
+}
+
+void NativeCode::emitRegisters(uint8_t*& out, uint8_t prefix, uint8_t opcode, int reg, int rm) {
+    out[0] = prefix;
+    out[1] = 0x0F;
+    out[2] = opcode;
+    out[3] = (uint8_t)(0xC0 | reg << 3 | rm);
+    out += 4;
+}
+
+bool NativeCode::assemble(const TapeEntry* tape, const uint32_t* positions, size_t count) {
+#ifdef CHIPSIM_X86_JIT
+    // Instruction bytes used below; F2 selects the scalar double form, 66 the packed one
+    const uint8_t SD = 0xF2, PD = 0x66;
+    const uint8_t MOVSD_LOAD = 0x10, MOVSD_STORE = 0x11, MOVAPD = 0x28, ANDPD = 0x54, XORPD = 0x57;
+    const uint8_t ADDSD = 0x58, MULSD = 0x59, SUBSD = 0x5C, DIVSD = 0x5E, CMPSD = 0xC2;
+    const uint8_t CMP_NOT_EQUAL = 4, RET = 0xC3;
+    const uint32_t MAX_SLOT = INT32_MAX / 8;   // Offsets must fit a signed 32-bit displacement
+
+    // Code is written straight into the mapping, sized for the longest
+    // entry, a division of 41 bytes; pages past the end are never touched
+    size_t capacity = count * 41 + 1;
+    void* mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    uint8_t* out = static_cast<uint8_t*>(mapping);
+    uint32_t inXmm0 = UINT32_MAX;  // Slot whose value xmm0 holds
+    for (size_t i = 0; i < count; i++) {
+        const TapeEntry& e = tape[positions != nullptr ? positions[i] : i];
+        if (e.src1 > MAX_SLOT || e.src2 > MAX_SLOT || e.dst > MAX_SLOT) {
+            munmap(mapping, capacity);
+            return false;
+        }
+        if (e.op == OP_NEG) {
+            // xmm0 = 0 - a
+            if (e.src1 == inXmm0) {
+                emitRegisters(out, PD, MOVAPD, 1, 0);
+            } else {
+                emitMemory(out, SD, MOVSD_LOAD, 1, e.src1);
+            }
+            emitRegisters(out, PD, XORPD, 0, 0);
+            emitRegisters(out, SD, SUBSD, 0, 1);
+        } else {
+            // xmm0 = a, or b for a commutative operation whose b is already there
+            bool swapped = (e.op == OP_ADD || e.op == OP_MUL) && e.src1 != inXmm0 && e.src2 == inXmm0;
+            uint32_t first = swapped ? e.src2 : e.src1;
+            uint32_t second = swapped ? e.src1 : e.src2;
+            if (first != inXmm0) {
+                emitMemory(out, SD, MOVSD_LOAD, 0, first);
+            }
+            switch (e.op) {
+                case OP_ADD: emitMemory(out, SD, ADDSD, 0, second); break;
+                case OP_SUB: emitMemory(out, SD, SUBSD, 0, second); break;
+                case OP_MUL: emitMemory(out, SD, MULSD, 0, second); break;
+                case OP_DIV:
+                    // xmm0 = a / b, then cleared through a mask of b != 0
+                    emitMemory(out, SD, MOVSD_LOAD, 1, second);
+                    emitRegisters(out, SD, DIVSD, 0, 1);
+                    emitRegisters(out, PD, XORPD, 2, 2);
+                    emitRegisters(out, SD, CMPSD, 1, 2);
+                    *out++ = CMP_NOT_EQUAL;
+                    emitRegisters(out, PD, ANDPD, 0, 1);
+                    break;
+                default: break;   // OP_OUT copies a
+            }
+        }
+        emitMemory(out, SD, MOVSD_STORE, 0, e.dst);
+        inXmm0 = e.dst;
+    }
+    *out++ = RET;
+
+    if (mprotect(mapping, capacity, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mapping, capacity);
+        return false;
+    }
+    if (code != nullptr) {
+        munmap(code, size);
+    }
+    code = mapping;
+    size = capacity;
+    return true;
+#else
+    (void)tape;
+    (void)positions;
+    (void)count;
+    return false;
+#endif
+}
+
+// A circuit compiled into a flat, topologically ordered tape over a dense
+// value array. Every chip owns one value slot, and one extra slot past the
+// last chip holds the constant zero that unconnected inputs read. Evaluating
+// the circuit is a single forward loop over the tape.
+//
+// A chip that reaches a cycle through its inputs has no value to compute. It
+// gets a value slot but no tape entry, and only chips that reach the same
+// cycle read it, so the cone of any other chip never includes it.
+//
+// Slots are normally numbered in the depth-first post-order of the compile
+// walk rather than by chip handle, and the tape keeps that order, so the
+// loop writes slots in ascending order and a chip's inputs usually sit in
+// the slots just before its own, often written by the entry just before.
+// Chip handles only come back into play for queries and error messages.
+//
+// Entries of one level, the longest path from an input chip, only read
+// values of earlier levels and can be evaluated in parallel. Levels are
+// derived on the first level run, and each cone that run evaluates keeps a
+// copy of its entries grouped by level, so the sequential engines keep the
+// evaluation order.
+//
+// Changing an input value marks the tape entries that read it as pending.
+// update() then re-evaluates pending entries in tape order and only marks an
+// entry's consumers when its value actually changed, so the work done is
+// proportional to the part of the fan-out cone the change reaches.
+//
+// A query only needs the cone of influence of the queried chips: the tape
+// entries in their transitive fan-in. Cones are built on the first query of
+// a chip list and the tape, level and work-stealing runs evaluate only the
+// entries of the cone. Recently used cones are kept for later queries, up to
+// CONE_CACHE_TAPES times the size of the tape in all; the least recently
+// used ones are dropped to make room.
+class CompiledCircuit {
+public:
+    // Interpreted runs of a cone before runNative() compiles it
+    static const uint32_t NATIVE_AFTER_RUNS = 4;
+
+    // Largest cone runNative() compiles. Past about a million entries the
+    // machine code (some 25 bytes per entry) no longer streams through the
+    // instruction cache faster than the VM reads its 16-byte entries.
+    static const size_t NATIVE_MAX_ENTRIES = (size_t)1 << 20;
+
+    // Tape entries the cached cones may list in all, as a multiple of the
+    // tape size, and the least the cache holds however small the tape is
+    static const size_t CONE_CACHE_TAPES = 16;
+    static const size_t MIN_CONE_CACHE_ENTRIES = (size_t)1 << 16;
+
+    struct Cone {
+        vector<uint32_t> entries;      // Tape positions in the cone, in tape order
+        vector<uint32_t> sources;      // Entries that read no other tape entry
+        vector<uint32_t> divides;      // Entries that are division chips, in the order compute() reaches them
+        vector<uint32_t> divideIndex;  // Indexes into divides, sorted by tape position
+        bool complete = true;          // False if only divides and divideIndex were filled in
+
+        // Machine code of the cone for runNative(), built once the cone has
+        // been interpreted NATIVE_AFTER_RUNS times
+        mutable unique_ptr<NativeCode> native;
+        mutable uint32_t interpretedRuns = 0;
+
+        // The entries grouped by level, each level in tape order, and the
+        // index into levelEntries where each level starts plus the end;
+        // built on the first runLevels() of the cone
+        mutable vector<uint32_t> levelEntries;
+        mutable vector<uint32_t> levelStarts;
+    };
+
+private:
+    ImageArray<TapeEntry> tape;          // Operations in the post-order of the compile walk
+    vector<double> values;               // Value of every slot, the zero slot last
+    ImageArray<uint32_t> slotOf;         // Value slot of each chip
+    ImageArray<ChipHandle> chipOf;       // Chip owning each value slot (NO_CHIP for the zero slot)
+    vector<uint32_t> consumerStart;      // Offset of each slot's consumers in consumerEntries, plus the end
+    vector<uint32_t> consumerEntries;    // Tape positions reading each value slot, grouped by slot
+    ImageArray<uint32_t> divideEntries;  // Tape positions of division chips, for error reporting
+    set<uint32_t> divideFaults;          // Tape positions of division chips whose divisor is zero
+    vector<uint32_t> pending;            // Min-heap of tape positions awaiting re-evaluation
+    vector<uint8_t> queued;              // Whether each tape position is in the pending heap
+    vector<uint32_t> dependencies;       // Number of distinct tape entries each entry reads
+    ImageArray<uint32_t> entryOf;        // Tape position writing each value slot, or UINT32_MAX
+    vector<uint32_t> entryLevel;         // Level of each tape entry, built on the first level run
+    // A cached cone and its place in the recently used list
+    struct CachedCone {
+        Cone cone;
+        list<const vector<ChipHandle>*>::iterator use;
+    };
+
+    map<vector<ChipHandle>, CachedCone> cones;    // Cones of recently queried chip lists
+    list<const vector<ChipHandle>*> coneUse;      // Keys of the cached cones, least recently used first
+    size_t cachedEntries;                         // Tape entries held by the cached cones
+    vector<uint32_t> coneMark;           // Stamp of the last cone walk or run that included each entry; allocated on first use
+    uint32_t coneStamp;                  // Current stamp for coneMark
+    unique_ptr<atomic<uint32_t>[]> remaining;  // Unfinished inputs of each entry during runStealing
+    unique_ptr<NativeCode> native;       // Machine code of the whole tape, built on first use
+    bool fanoutBuilt;                    // True once the consumer rows and dependency counts exist
+    bool evaluated;                      // True once values reflect a full run of the tape
+    ChipHandle cycleChip;                // A chip on the first cycle compile() found, else NO_CHIP
+    vector<ChipHandle> cycleOf;          // Chip on a cycle each chip reaches, or NO_CHIP; empty without cycles
+
+    // Queues every tape entry that reads the given value slot
+    void markConsumers(uint32_t slot);
+
+    // Evaluates the tape entries in [begin, end)
+    void runRange(size_t begin, size_t end);
+
+    // Rebuilds the division faults after a full run and drops pending work
+    void finishRun();
+
+    // Rebuilds the division faults of the entries in a cone after running it
+    void finishCone(const Cone& cone);
+
+    // Starts a new coneMark stamp, clearing the marks when the stamp wraps
+    uint32_t nextConeStamp();
+
+    // Fills an empty cone with the tape entries in the fan-in of the given
+    // chips, or only with their divisions if divisionsOnly is set
+    void buildCone(const vector<ChipHandle>& chips, bool divisionsOnly, Cone& cone);
+
+    // Returns how many entries a cached cone counts for against the cache size
+    static size_t cachedSize(const Cone& cone) {
+        return cone.entries.size() + cone.divides.size() + cone.levelEntries.size();
+    }
+
+    // Drops least recently used cones, other than the latest one, until the
+    // cache is within its size
+    void trimCones();
+
+    // Appends the faulting division entries of a cone, in the order compute() reaches them
+    void collectFaults(const Cone& cone, vector<uint32_t>& faults) const;
+
+    // Derives the sources of a cone from its entries, and its division
+    // index from its divisions
+    void indexCone(Cone& cone);
+
+    // Derives the level of every tape entry, once per compile
+    void buildLevels();
+
+    // Groups the entries of a cone by level for runLevels()
+    void levelCone(const Cone& cone);
+
+    // Derives the division list and the slot-to-entry map from the tape
+    void buildIndexes();
+
+    // Drops everything derived lazily from the tape: cones, fan-out
+    // indexes, machine code and pending work
+    void resetCaches();
+
+    // Runs count entries of the tape as bytecode: the entries at the given
+    // positions if INDEXED is set, or the first count otherwise
+    template <bool INDEXED>
+    static void execute(const TapeEntry* tape, const uint32_t* positions, size_t count, double* v);
+
+    // Derives the consumer rows and dependency counts from the tape, once per compile
+    void buildFanoutIndexes();
+
+public:
+    CompiledCircuit();
+
+    // Topologically sorts the circuit and emits its tape, numbering the value
+    // slots in evaluation order if renumber is set and by chip handle
+    // otherwise. Chips that reach a cycle get no tape entry; returns false
+    // if there are any.
+    bool compile(const Circuit& circuit, bool renumber);
+
+    // Writes the tape, the slot numbering and the indexes derived from them
+    // to a circuit image
+    void save(ImageWriter& image) const;
+
+    // Replaces the compiled form with the one stored in a circuit image for a
+    // circuit of numChips chips, used in place; input values start at zero.
+    // Returns false if the sections do not fit together.
+    bool load(ImageReader& image, uint32_t numChips);
+
+    // Returns the cone of influence of a list of chips, with every shared
+    // entry once, building it unless the same list was queried recently.
+    // Lists with the same chips in another order are kept apart, since the
+    // order decides the order of the division errors. With divisionsOnly
+    // the cone may list only its divisions, which is all that
+    // reportDivisionErrors() reads. The cone stays valid until the next call.
+    const Cone& coneOf(const vector<ChipHandle>& chips, bool divisionsOnly);
+
+    // Evaluates every tape entry in order
+    void run();
+
+    // Evaluates every tape entry in order, dispatching through OP_FUNCTIONS
+    // as the demand engine does instead of the switch in evalOp
+    void runTable();
+
+    // Evaluates the entries of a cone in order
+    void run(const Cone& cone);
+
+    // Evaluates every tape entry in order with the bytecode VM
+    void runBytecode();
+
+    // Evaluates the entries of a cone in order with the bytecode VM
+    void runBytecode(const Cone& cone);
+
+    // Evaluates every tape entry with generated machine code, or with the
+    // bytecode VM where no code can be generated. Unlike runNative(cone) it
+    // compiles on the first run and at any size, for --bench.
+    void runNative();
+
+    // Evaluates the entries of a cone with generated machine code, or with
+    // the bytecode VM for its first runs, for cones past NATIVE_MAX_ENTRIES
+    // and where no code can be generated
+    void runNative(const Cone& cone);
+
+    // Evaluates the entries of a cone level by level, spreading wide levels
+    // over the pool; the first run of a cone groups its entries by level
+    void runLevels(ThreadPool& pool, const Cone& cone);
+
+    // Evaluates the entries of a cone as soon as the entries they read are
+    // done, with idle threads stealing ready entries from busy ones
+    void runStealing(ThreadPool& pool, const Cone& cone);
+
+    // Re-evaluates only the entries affected by input changes since the last run or update
+    void update();
+
+    // Prints an error for every division chip in a cone whose divisor was zero when last evaluated
+    void reportDivisionErrors(const ChipRegistry& registry, OutputWriter& writer, const Cone& cone) const;
+
+    // Sets the value of an input chip and marks its consumers for re-evaluation
+    void setInputValue(ChipHandle chip, double value);
+
+    // Returns the value of a chip after the last run
+    double getValue(ChipHandle chip) const {
+        return values[slotOf[chip]];
+    }
+
+    // Returns the value held in a slot after the last run
+    double getSlotValue(uint32_t slot) const {
+        return values[slot];
+    }
+
+    // Returns the value slot of a chip
+    uint32_t getSlot(ChipHandle chip) const {
+        return slotOf[chip];
+    }
+
+    // Returns the chip owning a value slot
+    ChipHandle getChip(uint32_t slot) const {
+        return chipOf[slot];
+    }
+
+    // Returns a chip on the first cycle compile() found, or NO_CHIP
+    ChipHandle getCycleChip() const {
+        return cycleChip;
+    }
+
+    // Returns a chip on a cycle the given chip reaches through its inputs,
+    // or NO_CHIP if its value can be computed
+    ChipHandle cycleThrough(ChipHandle chip) const {
+        return cycleOf.empty() ? NO_CHIP : cycleOf[chip];
+    }
+
+    // Returns the tape in evaluation order
+    const ImageArray<TapeEntry>& getTape() const {
+        return tape;
+    }
+
+    // Returns the number of value slots (one per chip plus the zero slot)
+    uint32_t getNumSlots() const {
+        return (uint32_t)values.size();
+    }
+};
+
+CompiledCircuit::CompiledCircuit() {
+    evaluated = false;
+    cycleChip = NO_CHIP;
+    coneStamp = 0;
+    cachedEntries = 0;
+    fanoutBuilt = false;
+}
+
+bool CompiledCircuit::compile(const Circuit& circuit, bool renumber) {
+    uint32_t numChips = circuit.size();
+    uint32_t zeroSlot = numChips;
+    vector<TapeEntry>& entries = tape.rebuild();
+    vector<uint32_t>& slots = slotOf.rebuild();
+    vector<ChipHandle>& chips = chipOf.rebuild();
+    divideFaults.clear();
+    pending.clear();
+    values.assign((size_t)numChips + 1, 0);
+    slots.resize(numChips);
+    chips.resize((size_t)numChips + 1);
+    chips[zeroSlot] = NO_CHIP;
+    uint32_t nextSlot = 0;
+    evaluated = false;
+    cycleChip = NO_CHIP;
+    cycleOf.clear();
+
+    // Iterative depth-first search over the input links; a chip is emitted
+    // after both of its inputs, which gives a topological order without
+    // recursing once per level of circuit depth
+    enum { UNVISITED, ON_PATH, DONE };
+    vector<uint8_t> state(numChips, UNVISITED);
+    vector<ChipHandle> stack;
+    for (ChipHandle root = 0; root < numChips; root++) {
+        if (state[root] != UNVISITED) {
+            continue;
+        }
+        stack.push_back(root);
+        while (!stack.empty()) {
+            ChipHandle chip = stack.back();
+            if (state[chip] == UNVISITED) {
+                state[chip] = ON_PATH;
+                ChipHandle inputs[2] = { circuit.getInput1(chip), circuit.getInput2(chip) };
+                for (ChipHandle in : inputs) {
+                    if (in == NO_CHIP || state[in] == DONE) {
+                        continue;
+                    }
+                    if (state[in] == ON_PATH) {
+                        // A link back into the current path closes a cycle through in
+                        if (cycleOf.empty()) {
+                            cycleOf.assign(numChips, NO_CHIP);
+                            cycleChip = in;
+                        }
+                        cycleOf[chip] = in;
+                        continue;
+                    }
+                    stack.push_back(in);
+                }
+                continue;
+            }
+            stack.pop_back();
+            if (state[chip] == DONE) {
+                continue;  // Reached again through another consumer
+            }
+            state[chip] = DONE;
+
+            // Give the chip its slot; its inputs are already done, so theirs are known
+            uint32_t slot = renumber ? nextSlot++ : chip;
+            slots[chip] = slot;
+            chips[slot] = chip;
+
+            // A chip that reaches a cycle, directly or through an input that
+            // does, keeps its slot at zero and gets no entry
+            ChipHandle in1 = circuit.getInput1(chip);
+            ChipHandle in2 = circuit.getInput2(chip);
+            if (!cycleOf.empty()) {
+                if (cycleOf[chip] == NO_CHIP && in1 != NO_CHIP) {
+                    cycleOf[chip] = cycleOf[in1];
+                }
+                if (cycleOf[chip] == NO_CHIP && in2 != NO_CHIP) {
+                    cycleOf[chip] = cycleOf[in2];
+                }
+                if (cycleOf[chip] != NO_CHIP) {
+                    continue;
+                }
+            }
+
+            // Emit the chip; input chips have no tape entry, their slot is set directly
+            char type = circuit.getChipType(chip);
+            if (type == 'I') {
+                values[slot] = circuit.getInputValue(chip);
+                continue;
+            }
+            OpCode op = opFromType(type);
+            if (op == OP_NONE) {
+                continue;
+            }
+            TapeEntry entry;
+            entry.op = op;
+            entry.src1 = in1 != NO_CHIP ? slots[in1] : zeroSlot;
+            entry.src2 = in2 != NO_CHIP ? slots[in2] : zeroSlot;
+            entry.dst = slot;
+            entries.push_back(entry);
+        }
+    }
+
+    buildIndexes();
+    return cycleChip == NO_CHIP;
+}
+
+void CompiledCircuit::buildIndexes() {
+    vector<uint32_t>& divides = divideEntries.rebuild();
+    for (uint32_t pos = 0; pos < tape.size(); pos++) {
+        if (tape[pos].op == OP_DIV) {
+            divides.push_back(pos);
+        }
+    }
+    vector<uint32_t>& writers = entryOf.rebuild();
+    writers.assign(values.size(), UINT32_MAX);
+    for (uint32_t pos = 0; pos < tape.size(); pos++) {
+        writers[tape[pos].dst] = pos;
+    }
+    resetCaches();
+}
+
+void CompiledCircuit::resetCaches() {
+    native.reset();
+    divideFaults.clear();
+    pending.clear();
+
+    // Cones are rebuilt lazily against the new tape
+    cones.clear();
+    coneUse.clear();
+    cachedEntries = 0;
+    vector<uint32_t>().swap(coneMark);
+    coneStamp = 0;
+
+    // So are the fan-out indexes, which only the incremental and
+    // work-stealing runs use
+    consumerStart.clear();
+    consumerEntries.clear();
+    queued.clear();
+    dependencies.clear();
+    remaining.reset();
+    fanoutBuilt = false;
+    entryLevel.clear();
+}
+
+void CompiledCircuit::buildLevels() {
+    if (entryLevel.size() == tape.size()) {
+        return;
+    }
+
+    // An entry's level is one more than the deepest entry it reads, and
+    // entries that read none are level 0; every entry follows the ones it
+    // reads in the tape, so one pass sees their levels first
+    entryLevel.resize(tape.size());
+    for (uint32_t pos = 0; pos < tape.size(); pos++) {
+        uint32_t in1 = entryOf[tape[pos].src1];
+        uint32_t in2 = entryOf[tape[pos].src2];
+        uint32_t level = in1 != UINT32_MAX ? entryLevel[in1] + 1 : 0;
+        if (in2 != UINT32_MAX) {
+            level = max(level, entryLevel[in2] + 1);
+        }
+        entryLevel[pos] = level;
+    }
+}
+
+void CompiledCircuit::levelCone(const Cone& cone) {
+    // A stable counting sort by level; every entry an entry reads is in the
+    // cone, so its levels run from 0 without gaps
+    uint32_t maxLevel = 0;
+    for (uint32_t pos : cone.entries) {
+        maxLevel = max(maxLevel, entryLevel[pos]);
+    }
+    cone.levelStarts.assign((size_t)maxLevel + 2, 0);
+    for (uint32_t pos : cone.entries) {
+        cone.levelStarts[(size_t)entryLevel[pos] + 1]++;
+    }
+    for (size_t l = 1; l < cone.levelStarts.size(); l++) {
+        cone.levelStarts[l] += cone.levelStarts[l - 1];
+    }
+    cone.levelEntries.resize(cone.entries.size());
+    vector<uint32_t> fill(cone.levelStarts.begin(), cone.levelStarts.end() - 1);
+    for (uint32_t pos : cone.entries) {
+        cone.levelEntries[fill[entryLevel[pos]]++] = pos;
+    }
+}
+
+void CompiledCircuit::buildFanoutIndexes() {
+    if (fanoutBuilt) {
+        return;
+    }
+    size_t numSlots = values.size();
+    uint32_t zeroSlot = (uint32_t)numSlots - 1;
+
+    // Record which entries read each slot as compressed rows: count the
+    // readers of each slot, turn the counts into offsets, then place the
+    // readers in tape order. The zero slot never changes and gets none.
+    consumerStart.assign(numSlots + 1, 0);
+    for (const TapeEntry& e : tape) {
+        if (e.src1 != zeroSlot) {
+            consumerStart[(size_t)e.src1 + 1]++;
+        }
+        if (e.src2 != e.src1 && e.src2 != zeroSlot) {
+            consumerStart[(size_t)e.src2 + 1]++;
+        }
+    }
+    for (size_t slot = 0; slot < numSlots; slot++) {
+        consumerStart[slot + 1] += consumerStart[slot];
+    }
+    consumerEntries.resize(consumerStart[numSlots]);
+    vector<uint32_t> fill(consumerStart.begin(), consumerStart.end() - 1);
+    for (uint32_t pos = 0; pos < tape.size(); pos++) {
+        const TapeEntry& e = tape[pos];
+        if (e.src1 != zeroSlot) {
+            consumerEntries[fill[e.src1]++] = pos;
+        }
+        if (e.src2 != e.src1 && e.src2 != zeroSlot) {
+            consumerEntries[fill[e.src2]++] = pos;
+        }
+    }
+    queued.assign(tape.size(), 0);
+
+    // Count the tape entries each entry waits for; input chips, unknown chips
+    // and the zero slot are never written by the tape
+    dependencies.assign(tape.size(), 0);
+    for (uint32_t pos = 0; pos < tape.size(); pos++) {
+        const TapeEntry& e = tape[pos];
+        dependencies[pos] = (entryOf[e.src1] != UINT32_MAX) + (e.src2 != e.src1 && entryOf[e.src2] != UINT32_MAX);
+    }
+    remaining.reset(new atomic<uint32_t>[tape.size()]);
+    fanoutBuilt = true;
+}
+
+uint32_t CompiledCircuit::nextConeStamp() {
+    if (coneMark.size() != tape.size()) {
+        coneMark.assign(tape.size(), 0);
+        coneStamp = 0;
+    }
+    if (++coneStamp == 0) {
+        fill(coneMark.begin(), coneMark.end(), 0);
+        coneStamp = 1;
+    }
+    return coneStamp;
+}
+
+const CompiledCircuit::Cone& CompiledCircuit::coneOf(const vector<ChipHandle>& chips, bool divisionsOnly) {
+    auto found = cones.find(chips);
+    if (found != cones.end()) {
+        if (found->second.cone.complete || divisionsOnly) {
+            coneUse.splice(coneUse.end(), coneUse, found->second.use);   // Now the most recently used
+            return found->second.cone;
+        }
+        cachedEntries -= cachedSize(found->second.cone);
+        coneUse.erase(found->second.use);
+        cones.erase(found);
+    }
+
+    found = cones.emplace(chips, CachedCone()).first;
+    Cone& cone = found->second.cone;
+    buildCone(chips, divisionsOnly, cone);
+    found->second.use = coneUse.insert(coneUse.end(), &found->first);
+    cachedEntries += cachedSize(cone);
+    trimCones();
+    return cone;
+}
+
+void CompiledCircuit::trimCones() {
+    // Entries bound every other array of a cone and its machine code, so
+    // counting them bounds the memory of the cache
+    size_t limit = CONE_CACHE_TAPES * tape.size();
+    if (limit < MIN_CONE_CACHE_ENTRIES) {
+        limit = MIN_CONE_CACHE_ENTRIES;
+    }
+    while (cachedEntries > limit && coneUse.size() > 1) {
+        auto oldest = cones.find(*coneUse.front());
+        cachedEntries -= cachedSize(oldest->second.cone);
+        coneUse.pop_front();
+        cones.erase(oldest);
+    }
+}
+
+void CompiledCircuit::buildCone(const vector<ChipHandle>& chips, bool divisionsOnly, Cone& cone) {
+    // Walk the input links back from the chips in the post-order of
+    // Circuit::compute (first chip first, input1 before input2), so division
+    // errors come out in the order the demand engine prints them. Input chips,
+    // unknown chips and the zero slot have no tape entry and end the walk.
+    const uint32_t EXPANDED = 1u << 31;   // Marks a stack item whose inputs were pushed
+    uint32_t stamp = nextConeStamp();
+    size_t count = 0;
+    vector<uint32_t> stack;
+    for (ChipHandle chip : chips) {
+        stack.push_back(entryOf[slotOf[chip]]);
+        while (!stack.empty()) {
+            uint32_t item = stack.back();
+            if (item == UINT32_MAX || (item & EXPANDED) != 0) {
+                stack.pop_back();
+                if (item != UINT32_MAX) {
+                    uint32_t pos = item & ~EXPANDED;
+                    count++;
+                    if (tape[pos].op == OP_DIV) {
+                        cone.divides.push_back(pos);
+                    }
+                    if (!divisionsOnly) {
+                        cone.entries.push_back(pos);
+                    }
+                }
+                continue;
+            }
+            if (coneMark[item] == stamp) {
+                stack.pop_back();   // Already walked through another consumer
+                continue;
+            }
+            coneMark[item] = stamp;
+            stack.back() = item | EXPANDED;
+            uint32_t in1 = entryOf[tape[item].src1];
+            uint32_t in2 = entryOf[tape[item].src2];
+            if (in2 != UINT32_MAX && coneMark[in2] != stamp) {
+                stack.push_back(in2);
+            }
+            if (in1 != UINT32_MAX && coneMark[in1] != stamp) {
+                stack.push_back(in1);
+            }
+        }
+    }
+    cone.complete = !divisionsOnly;
+
+    // The walk stamped every entry of the cone, so a large cone is put in
+    // tape order by one sweep over the stamps, which is cheaper than sorting
+    if (cone.complete && count < tape.size() / 16) {
+        sort(cone.entries.begin(), cone.entries.end());
+    } else if (cone.complete) {
+        cone.entries.clear();
+        for (uint32_t pos = 0; cone.entries.size() < count; pos++) {
+            if (coneMark[pos] == stamp) {
+                cone.entries.push_back(pos);
+            }
+        }
+    }
+    indexCone(cone);
+}
+
+void CompiledCircuit::indexCone(Cone& cone) {
+    for (uint32_t pos : cone.entries) {
+        if (entryOf[tape[pos].src1] == UINT32_MAX && entryOf[tape[pos].src2] == UINT32_MAX) {
+            cone.sources.push_back(pos);
+        }
+    }
+
+    cone.divideIndex.resize(cone.divides.size());
+    for (uint32_t i = 0; i < cone.divides.size(); i++) {
+        cone.divideIndex[i] = i;
+    }
+    sort(cone.divideIndex.begin(), cone.divideIndex.end(),
+         [&cone](uint32_t a, uint32_t b) { return cone.divides[a] < cone.divides[b]; });
+}
+
+void CompiledCircuit::save(ImageWriter& image) const {
+    image.writeValue((uint64_t)tape.size());
+    image.writeArray(tape.data(), tape.size());
+    image.writeArray(slotOf.data(), slotOf.size());
+    image.writeArray(chipOf.data(), chipOf.size());
+    image.writeArray(entryOf.data(), entryOf.size());
+    image.writeValue((uint64_t)divideEntries.size());
+    image.writeArray(divideEntries.data(), divideEntries.size());
+}
+
+bool CompiledCircuit::load(ImageReader& image, uint32_t numChips) {
+    // Every index is checked as it is hashed, since the generated machine
+    // code stores wherever a tape entry points. Tape entries read slots and
+    // write chip slots, and no slot is written twice or read before it is
+    // written, so the tape is in evaluation order and the dependency counts
+    // of runStealing() all reach zero. The slot maps agree with the tape,
+    // and the division list holds as many ascending tape positions as the
+    // tape has divisions.
+    const uint8_t READ = 1, WRITTEN = 2;
+    uint64_t count;
+    uint64_t numSlots = (uint64_t)numChips + 1;
+    vector<uint8_t> slotUse((size_t)numSlots, 0);
+    uint64_t divisions = 0;
+    auto validEntry = [&](const TapeEntry& e, size_t) {
+        divisions += e.op == OP_DIV;
+        if (e.op >= OP_NONE || e.src1 >= numSlots || e.src2 >= numSlots || e.dst >= numChips) {
+            return false;
+        }
+        slotUse[e.src1] |= READ;
+        slotUse[e.src2] |= READ;
+        bool valid = slotUse[e.dst] == 0;
+        slotUse[e.dst] |= WRITTEN;
+        return valid;
+    };
+    auto validSlot = [numChips](uint32_t slot, size_t) { return slot < numChips; };
+    auto validChip = [numChips](ChipHandle chip, size_t slot) {
+        return (slot < numChips) == (chip < numChips) && (chip < numChips || chip == NO_CHIP);
+    };
+    auto validWriter = [&](uint32_t pos, size_t slot) {
+        if (pos == UINT32_MAX) {
+            return !(slotUse[slot] & WRITTEN);
+        }
+        return pos < tape.size() && tape[pos].dst == slot;
+    };
+    uint32_t nextDivide = 0;
+    auto validDivide = [&](uint32_t pos, size_t) {
+        bool valid = pos >= nextDivide && pos < tape.size();
+        nextDivide = pos + 1;
+        return valid;
+    };
+    if (!image.readValue(count) || count >= UINT32_MAX || !image.readArray(tape, count, validEntry) ||
+        !image.readArray(slotOf, numChips, validSlot) || !image.readArray(chipOf, numSlots, validChip) ||
+        !image.readArray(entryOf, numSlots, validWriter) ||
+        !image.readValue(count) || count != divisions || !image.readArray(divideEntries, count, validDivide)) {
+        return false;
+    }
+
+    values.assign((size_t)numSlots, 0);
+    evaluated = false;
+    cycleChip = NO_CHIP;   // Circuits with a cycle are not saved
+    cycleOf.clear();
+    resetCaches();
+    return true;
+}
+
+void CompiledCircuit::runRange(size_t begin, size_t end) {
+    double* v = values.data();
+    const TapeEntry* t = tape.data();
+    for (size_t pos = begin; pos < end; pos++) {
+        const TapeEntry& e = t[pos];
+        v[e.dst] = evalOp(e.op, v[e.src1], v[e.src2]);
+    }
+}
+
+void CompiledCircuit::finishRun() {
+    // A full run supersedes any pending incremental work
+    for (uint32_t pos : pending) {
+        queued[pos] = 0;
+    }
+    pending.clear();
+    divideFaults.clear();
+    for (uint32_t pos : divideEntries) {
+        if (values[tape[pos].src2] == 0) {
+            divideFaults.insert(pos);
+        }
+    }
+    evaluated = true;
+}
+
+void CompiledCircuit::run() {
+    runRange(0, tape.size());
+    finishRun();
+}
+
+void CompiledCircuit::runTable() {
+    double* v = values.data();
+    for (const TapeEntry& e : tape) {
+        v[e.dst] = OP_FUNCTIONS[e.op](v[e.src1], v[e.src2]);
+    }
+    finishRun();
+}
+
+void CompiledCircuit::finishCone(const Cone& cone) {
+    for (uint32_t pos : cone.divides) {
+        if (values[tape[pos].src2] == 0) {
+            divideFaults.insert(pos);
+        } else {
+            divideFaults.erase(pos);
+        }
+    }
+}
+
+void CompiledCircuit::run(const Cone& cone) {
+    double* v = values.data();
+    const TapeEntry* t = tape.data();
+    for (uint32_t pos : cone.entries) {
+        const TapeEntry& e = t[pos];
+        v[e.dst] = evalOp(e.op, v[e.src1], v[e.src2]);
+    }
+    finishCone(cone);
+}
+
+template <bool INDEXED>
+void CompiledCircuit::execute(const TapeEntry* tape, const uint32_t* positions, size_t count, double* v) {
+    if (count == 0) {
+        return;
+    }
+    size_t i = 0;
+    const TapeEntry* ip = INDEXED ? tape + positions[0] : tape;
+#ifdef CHIPSIM_COMPUTED_GOTO
+    // Each handler jumps straight to the next one, so every operation has its
+    // own indirect branch for the predictor. A cone is run in place through
+    // its positions, so no cone needs a copy of its entries.
+    static const void* const handlers[OP_NONE] = {
+        &&doAdd, &&doSub, &&doMul, &&doDiv, &&doNeg, &&doOut
+    };
+#define CHIPSIM_NEXT_ENTRY()                              \
+    if (++i == count) {                                   \
+        return;                                           \
+    }                                                     \
+    ip = INDEXED ? tape + positions[i] : ip + 1;          \
+    goto *handlers[ip->op]
+
+    goto *handlers[ip->op];
+doAdd:
+    v[ip->dst] = evalOp(OP_ADD, v[ip->src1], v[ip->src2]);
+    CHIPSIM_NEXT_ENTRY();
+doSub:
+    v[ip->dst] = evalOp(OP_SUB, v[ip->src1], v[ip->src2]);
+    CHIPSIM_NEXT_ENTRY();
+doMul:
+    v[ip->dst] = evalOp(OP_MUL, v[ip->src1], v[ip->src2]);
+    CHIPSIM_NEXT_ENTRY();
+doDiv:
+    v[ip->dst] = evalOp(OP_DIV, v[ip->src1], v[ip->src2]);
+    CHIPSIM_NEXT_ENTRY();
+doNeg:
+    v[ip->dst] = evalOp(OP_NEG, v[ip->src1], v[ip->src2]);
+    CHIPSIM_NEXT_ENTRY();
+doOut:
+    v[ip->dst] = evalOp(OP_OUT, v[ip->src1], v[ip->src2]);
+    CHIPSIM_NEXT_ENTRY();
+#undef CHIPSIM_NEXT_ENTRY
+#else
+    for (;;) {
+        v[ip->dst] = evalOp(ip->op, v[ip->src1], v[ip->src2]);
+        if (++i == count) {
+            return;
+        }
+        ip = INDEXED ? tape + positions[i] : ip + 1;
+    }
+#endif
+}
+
+void CompiledCircuit::runBytecode() {
+    execute<false>(tape.data(), nullptr, tape.size(), values.data());
+    finishRun();
+}
+
+void CompiledCircuit::runBytecode(const Cone& cone) {
+    execute<true>(tape.data(), cone.entries.data(), cone.entries.size(), values.data());
+    finishCone(cone);
+}
+
+void CompiledCircuit::runNative() {
+    if (!native) {
+        native.reset(new NativeCode());
+        native->assemble(tape.data(), nullptr, tape.size());
+    }
+    if (!native->ready()) {
+        runBytecode();
+        return;
+    }
+    native->run(values.data());
+    finishRun();
+}
+
+void CompiledCircuit::runNative(const Cone& cone) {
+    if (!cone.native) {
+        // Assembling a cone takes about as long as its machine code saves
+        // over the VM in four runs, so only cones that keep being queried
+        // are compiled
+        if (cone.interpretedRuns < NATIVE_AFTER_RUNS || cone.entries.size() > NATIVE_MAX_ENTRIES) {
+            cone.interpretedRuns += cone.interpretedRuns < NATIVE_AFTER_RUNS;
+            runBytecode(cone);
+            return;
+        }
+        cone.native.reset(new NativeCode());
+        cone.native->assemble(tape.data(), cone.entries.data(), cone.entries.size());
+    }
+    if (!cone.native->ready()) {
+        runBytecode(cone);
+        return;
+    }
+    cone.native->run(values.data());
+    finishCone(cone);
+}
+
+void CompiledCircuit::runLevels(ThreadPool& pool, const Cone& cone) {
+    // Levels narrower than this run on the calling thread; waking the pool
+    // costs more than evaluating a few thousand entries
+    const size_t PARALLEL_GRAIN = 4096;
+    if (cone.levelStarts.empty()) {
+        buildLevels();
+        levelCone(cone);
+        cachedEntries += cone.levelEntries.size();   // The cone was just used, so trimming keeps it
+        trimCones();
+    }
+    double* v = values.data();
+    const TapeEntry* t = tape.data();
+    const uint32_t* entries = cone.levelEntries.data();
+    auto runEntries = [v, t, entries](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const TapeEntry& e = t[entries[i]];
+            v[e.dst] = evalOp(e.op, v[e.src1], v[e.src2]);
+        }
+    };
+    function<void(size_t, size_t)> body;
+    for (size_t l = 0; l + 1 < cone.levelStarts.size(); l++) {
+        size_t begin = cone.levelStarts[l];
+        size_t end = cone.levelStarts[l + 1];
+        if (end - begin < PARALLEL_GRAIN || pool.size() == 1) {
+            runEntries(begin, end);
+            continue;
+        }
+        body = [&runEntries, begin](size_t from, size_t to) { runEntries(begin + from, begin + to); };
+        size_t chunk = max<size_t>(PARALLEL_GRAIN / 4, (end - begin) / (pool.size() * 4));
+        pool.parallelFor(end - begin, chunk, body);   // Returns only when the whole level is done
+    }
+    finishCone(cone);
+}
+
+void CompiledCircuit::runStealing(ThreadPool& pool, const Cone& cone) {
+    buildFanoutIndexes();
+    size_t numWorkers = pool.size();
+    size_t total = cone.entries.size();
+    unique_ptr<WorkDeque[]> deques(new WorkDeque[numWorkers]);
+
+    // Consumers outside the cone are never scheduled; every entry the cone
+    // reads is itself in the cone, so the dependency counts carry over as is
+    uint32_t stamp = nextConeStamp();
+    for (uint32_t pos : cone.entries) {
+        coneMark[pos] = stamp;
+        remaining[pos].store(dependencies[pos], memory_order_relaxed);
+    }
+    for (size_t i = 0; i < cone.sources.size(); i++) {
+        deques[i % numWorkers].push(cone.sources[i]);
+    }
+
+    // A worker that finds nothing to run scans the deques a few more times,
+    // then parks until an entry is pushed or the run completes. Pushing only
+    // takes parkLock while some worker is parked, and the fences on both
+    // sides keep a push from slipping past a worker about to park.
+    const unsigned IDLE_SCANS = 64;
+    mutex parkLock;
+    condition_variable parkWake;
+    atomic<unsigned> parked(0);
+    uint64_t wakeups = 0;   // Guarded by parkLock; raised for every wake-up of parked workers
+    atomic<size_t> completed(0);
+    function<void(size_t, size_t)> body = [&](size_t firstWorker, size_t lastWorker) {
+        double* v = values.data();
+        for (size_t self = firstWorker; self < lastWorker; self++) {
+            WorkDeque& local = deques[self];
+            auto findWork = [&](uint32_t& pos) {
+                bool found = local.pop(pos);
+                for (size_t k = 1; !found && k < numWorkers; k++) {
+                    found = deques[(self + k) % numWorkers].steal(pos);
+                }
+                return found;
+            };
+            unsigned idleScans = 0;
+            while (completed.load(memory_order_acquire) < total) {
+                uint32_t pos;
+                bool found = findWork(pos);
+                if (!found && ++idleScans < IDLE_SCANS) {
+                    this_thread::yield();
+                    continue;
+                }
+                if (!found) {
+                    unique_lock<mutex> guard(parkLock);
+                    parked.fetch_add(1);
+                    atomic_thread_fence(memory_order_seq_cst);
+                    uint64_t seen = wakeups;
+                    found = findWork(pos);
+                    if (!found) {
+                        parkWake.wait(guard, [&] {
+                            return wakeups != seen || completed.load(memory_order_acquire) >= total;
+                        });
+                    }
+                    parked.fetch_sub(1);
+                    if (!found) {
+                        continue;
+                    }
+                }
+                idleScans = 0;
+
+                // Run the entry, then keep going with one newly ready consumer
+                // directly and leave the others in the deque for stealing
+                while (pos != UINT32_MAX) {
+                    const TapeEntry& e = tape[pos];
+                    v[e.dst] = evalOp(e.op, v[e.src1], v[e.src2]);
+                    uint32_t nextPos = UINT32_MAX;
+                    unsigned pushed = 0;
+                    const uint32_t* first = consumerEntries.data() + consumerStart[e.dst];
+                    const uint32_t* last = consumerEntries.data() + consumerStart[(size_t)e.dst + 1];
+                    for (const uint32_t* c = first; c != last; c++) {
+                        uint32_t consumer = *c;
+                        if (coneMark[consumer] != stamp) {
+                            continue;
+                        }
+                        if (remaining[consumer].fetch_sub(1, memory_order_acq_rel) == 1) {
+                            if (nextPos == UINT32_MAX) {
+                                nextPos = consumer;
+                            } else {
+                                local.push(consumer);
+                                pushed++;
+                            }
+                        }
+                    }
+                    if (pushed > 0) {
+                        atomic_thread_fence(memory_order_seq_cst);
+                        if (parked.load(memory_order_relaxed) > 0) {
+                            lock_guard<mutex> guard(parkLock);
+                            wakeups++;
+                            if (pushed == 1) {
+                                parkWake.notify_one();
+                            } else {
+                                parkWake.notify_all();
+                            }
+                        }
+                    }
+                    if (completed.fetch_add(1, memory_order_acq_rel) + 1 == total) {
+                        lock_guard<mutex> guard(parkLock);   // Parked workers leave once the run is complete
+                        parkWake.notify_all();
+                    }
+                    pos = nextPos;
+                }
+            }
+        }
+    };
+    pool.parallelFor(numWorkers, 1, body);
+    finishCone(cone);
+}
+
+void CompiledCircuit::markConsumers(uint32_t slot) {
+    for (uint32_t i = consumerStart[slot]; i < consumerStart[(size_t)slot + 1]; i++) {
+        uint32_t pos = consumerEntries[i];
+        if (!queued[pos]) {
+            queued[pos] = 1;
+            pending.push_back(pos);
+            push_heap(pending.begin(), pending.end(), greater<uint32_t>());
+        }
+    }
+}
+
+void CompiledCircuit::update() {
+    buildFanoutIndexes();
+    if (!evaluated) {
+        run();
+        return;
+    }
+
+    // Consumers always sit later in the tape than the entries they read, so
+    // taking the smallest pending position first evaluates each entry once,
+    // after all of its changed inputs
+    double* v = values.data();
+    while (!pending.empty()) {
+        pop_heap(pending.begin(), pending.end(), greater<uint32_t>());
+        uint32_t pos = pending.back();
+        pending.pop_back();
+        queued[pos] = 0;
+
+        const TapeEntry& e = tape[pos];
+        double before = v[e.dst];
+        double after = evalOp(e.op, v[e.src1], v[e.src2]);
+        if (e.op == OP_DIV) {
+            if (v[e.src2] == 0) {
+                divideFaults.insert(pos);
+            } else {
+                divideFaults.erase(pos);
+            }
+        }
+        if (memcmp(&before, &after, sizeof(double)) != 0) {
+            v[e.dst] = after;
+            markConsumers(e.dst);
+        }
+    }
+}
+
+void CompiledCircuit::collectFaults(const Cone& cone, vector<uint32_t>& faults) const {
+    if (divideFaults.size() >= cone.divides.size()) {
+        for (uint32_t pos : cone.divides) {
+            if (divideFaults.count(pos) != 0) {
+                faults.push_back(pos);
+            }
+        }
+        return;
+    }
+
+    // Usually only a few divisions fault, so look each fault up in the cone
+    // rather than checking every division of a large cone on every query
+    vector<uint32_t> found;
+    for (uint32_t pos : divideFaults) {
+        auto it = lower_bound(cone.divideIndex.begin(), cone.divideIndex.end(), pos,
+                              [&cone](uint32_t i, uint32_t target) { return cone.divides[i] < target; });
+        if (it != cone.divideIndex.end() && cone.divides[*it] == pos) {
+            found.push_back(*it);
+        }
+    }
+    sort(found.begin(), found.end());   // Back into the order compute() reaches them
+    for (uint32_t i : found) {
+        faults.push_back(cone.divides[i]);
+    }
+}
+
+void CompiledCircuit::reportDivisionErrors(const ChipRegistry& registry, OutputWriter& writer,
+                                           const Cone& cone) const {
+    vector<uint32_t> faults;
+    collectFaults(cone, faults);
+    for (uint32_t pos : faults) {
+        writer << "Error: Division by zero in chip " << registry.nameOf(chipOf[tape[pos].dst]) << '\n';
+    }
+}
+
+void CompiledCircuit::setInputValue(ChipHandle chip, double value) {
+    uint32_t slot = slotOf[chip];
+    if (memcmp(&values[slot], &value, sizeof(double)) == 0) {
+        return;  // Unchanged values leave the circuit clean
+    }
+    values[slot] = value;
+    if (evaluated) {
+        buildFanoutIndexes();
+        markConsumers(slot);
+    }
+}
+
+// Kernel applying one tape operation to n lanes: r[i] = op(a[i], b[i]).
+// Returns the number of lanes that divided by zero (always 0 for other ops).
+typedef uint64_t (*LaneKernel)(const double* a, const double* b, double* r, uint32_t n);
+
+// Scalar kernels, used on every platform and for the tails of the vector kernels
+uint64_t addLanesScalar(const double* a, const double* b, double* r, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) r[i] = evalOp(OP_ADD, a[i], b[i]);
+    return 0;
+}
+
+uint64_t subLanesScalar(const double* a, const double* b, double* r, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) r[i] = evalOp(OP_SUB, a[i], b[i]);
+    return 0;
+}
+
+uint64_t mulLanesScalar(const double* a, const double* b, double* r, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) r[i] = evalOp(OP_MUL, a[i], b[i]);
+    return 0;
+}
+
+uint64_t divLanesScalar(const double* a, const double* b, double* r, uint32_t n) {
+    uint64_t zeros = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        zeros += b[i] == 0;
+        r[i] = evalOp(OP_DIV, a[i], b[i]);
+    }
+    return zeros;
+}
+
+uint64_t negLanesScalar(const double* a, const double*, double* r, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) r[i] = evalOp(OP_NEG, a[i], 0);
+    return 0;
+}
+
+uint64_t copyLanes(const double* a, const double*, double* r, uint32_t n) {
+    memcpy(r, a, (size_t)n * sizeof(double));
+    return 0;
+}
+
+const LaneKernel SCALAR_LANE_KERNELS[OP_NONE] = {
+    addLanesScalar, subLanesScalar, mulLanesScalar, divLanesScalar, negLanesScalar, copyLanes
+};
+
+#ifdef CHIPSIM_X86_KERNELS
+// AVX2 kernels: four lanes per instruction. Division computes every quotient
+// and clears the lanes whose divisor compares equal to zero with a mask.
+#define CHIPSIM_AVX2_BINARY(name, intrinsic, scalar)                                 \
+    __attribute__((target("avx2")))                                                  \
+    uint64_t name(const double* a, const double* b, double* r, uint32_t n) {          \
+        uint32_t i = 0;                                                               \
+        for (; i + 4 <= n; i += 4) {                                                  \
+            _mm256_storeu_pd(r + i, intrinsic(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i))); \
+        }                                                                             \
+        return scalar(a + i, b + i, r + i, n - i);                                    \
+    }
+
+CHIPSIM_AVX2_BINARY(addLanesAvx2, _mm256_add_pd, addLanesScalar)
+CHIPSIM_AVX2_BINARY(subLanesAvx2, _mm256_sub_pd, subLanesScalar)
+CHIPSIM_AVX2_BINARY(mulLanesAvx2, _mm256_mul_pd, mulLanesScalar)
+
+__attribute__((target("avx2,popcnt")))
+uint64_t divLanesAvx2(const double* a, const double* b, double* r, uint32_t n) {
+    const __m256d zero = _mm256_setzero_pd();
+    uint64_t zeros = 0;
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d vb = _mm256_loadu_pd(b + i);
+        __m256d isZero = _mm256_cmp_pd(vb, zero, _CMP_EQ_OQ);
+        __m256d quotient = _mm256_div_pd(_mm256_loadu_pd(a + i), vb);
+        _mm256_storeu_pd(r + i, _mm256_andnot_pd(isZero, quotient));
+        zeros += (uint64_t)_mm_popcnt_u32((unsigned)_mm256_movemask_pd(isZero));
+    }
+    return zeros + divLanesScalar(a + i, b + i, r + i, n - i);
+}
+
+__attribute__((target("avx2")))
+uint64_t negLanesAvx2(const double* a, const double* b, double* r, uint32_t n) {
+    const __m256d zero = _mm256_setzero_pd();
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(r + i, _mm256_sub_pd(zero, _mm256_loadu_pd(a + i)));
+    }
+    return negLanesScalar(a + i, b + i, r + i, n - i);
+}
+
+const LaneKernel AVX2_LANE_KERNELS[OP_NONE] = {
+    addLanesAvx2, subLanesAvx2, mulLanesAvx2, divLanesAvx2, negLanesAvx2, copyLanes
+};
+
+// AVX-512 kernels: eight lanes per instruction, with the tail handled by a
+// lane mask instead of a scalar loop. Division only divides the lanes whose
+// divisor is non-zero and zero-fills the rest.
+#define CHIPSIM_AVX512_BINARY(name, intrinsic)                                        \
+    __attribute__((target("avx512f")))                                                \
+    uint64_t name(const double* a, const double* b, double* r, uint32_t n) {          \
+        for (uint32_t i = 0; i < n; i += 8) {                                         \
+            __mmask8 active = n - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1); \
+            __m512d va = _mm512_maskz_loadu_pd(active, a + i);                        \
+            __m512d vb = _mm512_maskz_loadu_pd(active, b + i);                        \
+            _mm512_mask_storeu_pd(r + i, active, intrinsic(va, vb));                  \
+        }                                                                             \
+        return 0;                                                                     \
+    }
+
+CHIPSIM_AVX512_BINARY(addLanesAvx512, _mm512_add_pd)
+CHIPSIM_AVX512_BINARY(subLanesAvx512, _mm512_sub_pd)
+CHIPSIM_AVX512_BINARY(mulLanesAvx512, _mm512_mul_pd)
+
+__attribute__((target("avx512f,popcnt")))
+uint64_t divLanesAvx512(const double* a, const double* b, double* r, uint32_t n) {
+    const __m512d zero = _mm512_setzero_pd();
+    uint64_t zeros = 0;
+    for (uint32_t i = 0; i < n; i += 8) {
+        __mmask8 active = n - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1);
+        __m512d va = _mm512_maskz_loadu_pd(active, a + i);
+        __m512d vb = _mm512_maskz_loadu_pd(active, b + i);
+        __mmask8 isZero = _mm512_mask_cmp_pd_mask(active, vb, zero, _CMP_EQ_OQ);
+        _mm512_mask_storeu_pd(r + i, active, _mm512_maskz_div_pd((__mmask8)~isZero, va, vb));
+        zeros += (uint64_t)_mm_popcnt_u32(isZero);
+    }
+    return zeros;
+}
+
+__attribute__((target("avx512f")))
+uint64_t negLanesAvx512(const double* a, const double*, double* r, uint32_t n) {
+    const __m512d zero = _mm512_setzero_pd();
+    for (uint32_t i = 0; i < n; i += 8) {
+        __mmask8 active = n - i >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1);
+        _mm512_mask_storeu_pd(r + i, active, _mm512_sub_pd(zero, _mm512_maskz_loadu_pd(active, a + i)));
+    }
+    return 0;
+}
+
+const LaneKernel AVX512_LANE_KERNELS[OP_NONE] = {
+    addLanesAvx512, subLanesAvx512, mulLanesAvx512, divLanesAvx512, negLanesAvx512, copyLanes
+};
+#endif
+
+// Instruction sets the batch kernels can be built for
+enum SimdLevel {
+    SIMD_AUTO,     // Best level the CPU supports
+    SIMD_SCALAR,   // Plain C++ loops
+    SIMD_AVX2,     // 256-bit vectors
+    SIMD_AVX512    // 512-bit vectors
+};
+
+// Returns the best instruction set the running CPU supports
+SimdLevel detectSimdLevel() {
+#ifdef CHIPSIM_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt")) {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return SIMD_AVX2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+// Returns the kernel table for the requested level, falling back to the best
+// level the CPU actually supports when the request cannot be honoured
+const LaneKernel* selectLaneKernels(SimdLevel requested) {
+    SimdLevel supported = detectSimdLevel();
+    SimdLevel level = requested == SIMD_AUTO || requested > supported ? supported : requested;
+#ifdef CHIPSIM_X86_KERNELS
+    if (level == SIMD_AVX512) {
+        return AVX512_LANE_KERNELS;
+    }
+    if (level == SIMD_AVX2) {
+        return AVX2_LANE_KERNELS;
+    }
+#endif
+    (void)level;
+    return SCALAR_LANE_KERNELS;
+}
+
+// Evaluates a compiled circuit for many input vectors at once. Every value
+// slot owns `width` contiguous lanes, one per vector, so each tape entry is
+// applied to a whole block of vectors before moving on to the next entry and
+// the tape is walked once per block instead of once per vector.
+class BatchEvaluator {
+private:
+    static const size_t MAX_LANE_BYTES = (size_t)512 << 20;  // Cap on the lane array size
+    static const uint32_t MAX_WIDTH = 256;                   // Vectors per block
+
+    const CompiledCircuit& compiled;  // Circuit being evaluated
+    const LaneKernel* kernels;        // Lane kernel for each operation
+    uint32_t width;                   // Lanes per value slot
+    vector<double> lanes;             // Lane values, slot-major
+    vector<uint64_t> divideFaults;    // Zero divisors seen so far, per tape position
+
+public:
+    // Sets up the lanes; every slot starts out holding its current scalar value in all lanes
+    BatchEvaluator(const CompiledCircuit& compiled, SimdLevel simd);
+
+    // Returns the number of vectors evaluated per block
+    uint32_t getWidth() const {
+        return width;
+    }
+
+    // Returns the lanes of a value slot
+    double* lanesOf(uint32_t slot) {
+        return &lanes[(size_t)slot * width];
+    }
+
+    // Evaluates the first n lanes of every tape entry
+    void evaluate(uint32_t n);
+
+    // Returns how many zero divisors the division entry at a tape position has seen
+    uint64_t getDivideFaults(uint32_t pos) const {
+        return divideFaults[pos];
+    }
+};
+
+BatchEvaluator::BatchEvaluator(const CompiledCircuit& compiled, SimdLevel simd) : compiled(compiled) {
+    kernels = selectLaneKernels(simd);
+    uint32_t numSlots = compiled.getNumSlots();
+    size_t fit = MAX_LANE_BYTES / ((size_t)numSlots * sizeof(double));
+    width = (uint32_t)max<size_t>(1, min<size_t>(MAX_WIDTH, fit));
+    if (width >= 8) {
+        width &= ~7u;  // Whole vector registers per slot
+    }
+    lanes.resize((size_t)numSlots * width);
+    for (uint32_t slot = 0; slot < numSlots; slot++) {
+        fill(lanes.begin() + (size_t)slot * width, lanes.begin() + (size_t)(slot + 1) * width,
+             compiled.getSlotValue(slot));
+    }
+    divideFaults.assign(compiled.getTape().size(), 0);
+}
+
+void BatchEvaluator::evaluate(uint32_t n) {
+    const ImageArray<TapeEntry>& tape = compiled.getTape();
+    for (uint32_t pos = 0; pos < tape.size(); pos++) {
+        const TapeEntry& e = tape[pos];
+        divideFaults[pos] += kernels[e.op](lanesOf(e.src1), lanesOf(e.src2), lanesOf(e.dst), n);
+    }
+}
+
+// Exact powers of ten that a double represents without rounding
+const double EXACT_POWERS_OF_TEN[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Parses a whole token as a decimal floating-point number: optional sign,
+// digits with an optional decimal point, and an optional exponent. Returns
+// false for anything else (including a partially numeric token), without any
+// stream or errno state. The result is always the correctly rounded double.
+//
+// Most input values have at most 15 significant digits and a small exponent;
+// those are converted with a single exact multiply or divide (every operand
+// is exactly representable, so the one rounding is the correct one). Only
+// longer or more extreme values take the general from_chars path.
+bool parseDouble(string_view token, double& value) {
+    const char* p = token.data();
+    const char* end = p + token.size();
+    bool negative = false;
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = *p == '-';
+        p++;
+    }
+    const char* numberStart = p;   // from_chars accepts '-' but not '+'
+
+    uint64_t mantissa = 0;     // First significant digits
+    int digits = 0;            // Significant digits in mantissa (leading zeros excluded)
+    int dropped = 0;           // Integer digits that did not fit in mantissa
+    int fractionDigits = 0;    // Digits after the point that went into mantissa
+    bool anyDigit = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        anyDigit = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            digits += mantissa != 0;
+        } else {
+            dropped++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+            anyDigit = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                digits += mantissa != 0;
+                fractionDigits++;
+            }
+        }
+    }
+    if (!anyDigit) {
+        return false;
+    }
+    int exponent = 0;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negativeExponent = false;
+        if (p < end && (*p == '+' || *p == '-')) {
+            negativeExponent = *p == '-';
+            p++;
+        }
+        if (p == end) {
+            return false;
+        }
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (exponent < 100000) {
+                exponent = exponent * 10 + (*p - '0');
+            }
+        }
+        if (negativeExponent) {
+            exponent = -exponent;
+        }
+    }
+    if (p != end) {
+        return false;
+    }
+
+    // Fast path: the mantissa and the power of ten are both exact doubles
+    int scale = exponent + dropped - fractionDigits;
+    if (digits <= 15 && scale >= -22 && scale <= 22) {
+        double result = (double)mantissa;
+        result = scale < 0 ? result / EXACT_POWERS_OF_TEN[-scale] : result * EXACT_POWERS_OF_TEN[scale];
+        value = negative ? -result : result;
+        return true;
+    }
+
+    // General path for long mantissas and large exponents
+    double result;
+    auto parsed = from_chars(numberStart, end, result);
+    if (parsed.ptr != end || (parsed.ec != errc() && parsed.ec != errc::result_out_of_range)) {
+        return false;
+    }
+    if (parsed.ec == errc::result_out_of_range) {
+        // Overflow becomes infinity and underflow zero, as with strtod. The
+        // value lies below 10^(digits + scale), so a positive decade overflowed.
+        result = digits + scale > 0 ? HUGE_VAL : 0.0;
+    }
+    value = negative ? -result : result;
+    return true;
+}
+
+// Bytes of an input file. Regular files, including a regular file redirected
+// to stdin, are memory-mapped and read in place; pipes and terminals are
+// read into one buffer with large block reads.
+class InputSource {
+private:
+    static const size_t READ_BLOCK = (size_t)1 << 20;   // Bytes per read() on non-mappable input
+
+    const char* bytes;     // Start of the input
+    size_t length;         // Number of bytes
+    bool mapped;           // True if bytes is a memory mapping that must be unmapped
+    vector<char> buffer;   // Storage for input that could not be mapped
+
+    // Maps or reads everything from an open file descriptor / stream
+    bool load(int fd, FILE* stream);
+
+public:
+    InputSource();
+    ~InputSource();
+
+    // Loads the file at the given path, mapping it unless copy is set;
+    // returns false if it cannot be read. A copy cannot change after it is
+    // checked, even if another process rewrites or truncates the file.
+    bool openFile(const string& path, bool copy = false);
+
+    // Loads everything from standard input
+    bool openStdin();
+
+    // Takes input generated in memory
+    void openText(const string& text);
+
+    // Returns the start of the input
+    const char* data() const {
+        return bytes;
+    }
+
+    // Returns the number of bytes of input
+    size_t size() const {
+        return length;
+    }
+};
+
+InputSource::InputSource() {
+    bytes = nullptr;
+    length = 0;
+    mapped = false;
+}
+
+InputSource::~InputSource() {
+#ifdef CHIPSIM_POSIX_IO
+    if (mapped) {
+        munmap((void*)bytes, length);
+    }
+#endif
+}
+
+bool InputSource::load(int fd, FILE* stream) {
+#ifdef CHIPSIM_POSIX_IO
+    struct stat info;
+    if (fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* mapping = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+            bytes = (const char*)mapping;
+            length = (size_t)info.st_size;
+            mapped = true;
+            return true;
+        }
+    }
+#else
+    (void)fd;
+#endif
+    size_t used = 0;
+    for (;;) {
+        buffer.resize(used + READ_BLOCK);
+        size_t got = fread(buffer.data() + used, 1, READ_BLOCK, stream);
+        used += got;
+        if (got < READ_BLOCK) {
+            break;
+        }
+    }
+    buffer.resize(used);
+    bytes = buffer.data();
+    length = used;
+    return !ferror(stream);
+}
+
+bool InputSource::openFile(const string& path, bool copy) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+#ifdef CHIPSIM_POSIX_IO
+    bool ok = load(copy ? -1 : fileno(file), file);
+#else
+    bool ok = load(-1, file);
+#endif
+    fclose(file);   // A mapping stays valid after its descriptor is closed
+    return ok;
+}
+
+void InputSource::openText(const string& text) {
+    buffer.assign(text.begin(), text.end());
+    bytes = buffer.data();
+    length = buffer.size();
+}
+
+bool InputSource::openStdin() {
+#ifdef CHIPSIM_POSIX_IO
+    return load(STDIN_FILENO, stdin);
+#else
+    return load(-1, stdin);
+#endif
+}
+
+// Parses a non-negative integer token; returns false if the token is empty or malformed
+bool parseCount(string_view token, int& count) {
+    auto parsed = from_chars(token.data(), token.data() + token.size(), count);
+    return !token.empty() && parsed.ec == errc() && parsed.ptr == token.data() + token.size() && count >= 0;
+}
+
+// Splits input bytes into whitespace-separated tokens. Tokens are views
+// straight into the input, so reading a netlist builds no temporary strings.
+class Tokenizer {
 private:
-    char chipType;        // Type of the chip (A: Addition, S: Subtraction, etc.)
-    string id;            // Unique identifier for the chip
-    Chip* input1;         // Pointer to the first input chip
-    Chip* input2;         // Pointer to the second input chip (optional, can be NULL)
-    Chip* output;         // Pointer to the output chip (NULL for output chips)
-    double inputValue;    // Input value for input chips (used in I type chips)
-    double result;        // Computed result for non-input chips
+    const char* pos;    // Next unread byte
+    const char* end;    // One past the last byte
 
 public:
-    // Constructor to initialize the chip with a type and unique ID
-    Chip(char type, const string& id);
+    Tokenizer(const char* data, size_t size) {
+        pos = data;
+        end = data + size;
+    }
 
-    // Sets the first input chip for this chip
-    void setInput1(Chip* inputChip);
+    // Returns the next token, or an empty view at the end of the input
+    string_view next() {
+        while (pos < end && (unsigned char)*pos <= ' ') {
+            pos++;
+        }
+        const char* start = pos;
+        while (pos < end && (unsigned char)*pos > ' ') {
+            pos++;
+        }
+        return string_view(start, (size_t)(pos - start));
+    }
 
-    // Sets the second input chip (used for operations requiring two inputs)
-    void setInput2(Chip* inputChip);
+    // Reads a non-negative integer token; returns false if the token is missing or malformed
+    bool nextCount(int& count) {
+        return parseCount(next(), count);
+    }
 
-    // Sets the output chip that this chip connects to
-    void setOutput(Chip* outputChip);
+    // Reads a floating-point token; returns false if the token is missing or malformed
+    bool nextDouble(double& value) {
+        return parseDouble(next(), value);
+    }
 
-    // Performs the operation based on the chip type
-    void compute();
+    // Returns the rest of the current line and moves to the start of the next one
+    string_view nextLine() {
+        const char* start = pos;
+        while (pos < end && *pos != '\n') {
+            pos++;
+        }
+        string_view line(start, (size_t)(pos - start));
+        if (pos < end) {
+            pos++;
+        }
+        return line;
+    }
 
-    // Displays the chip's details (inputs, outputs, ID)
-    void display() const;
+    // Returns true if only whitespace is left
+    bool atEnd() {
+        while (pos < end && (unsigned char)*pos <= ' ') {
+            pos++;
+        }
+        return pos == end;
+    }
+};
 
-    // Returns the chip's ID
-    string getId() const;
+// Returns an identifier of the running process, used to name temporary files
+uint64_t processId() {
+#ifdef CHIPSIM_POSIX_IO
+    return (uint64_t)getpid();
+#else
+    return (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
 
-    // Returns the chip's type (A, S, M, D, etc.)
-    char getChipType() const;
+// Fingerprints a text netlist for the circuit cache without interning
+// anything. Returns false if the netlist cannot be served from a cache: when
+// an O command comes before the last A command, the queries depend on the
+// order in which connections were made.
+bool fingerprintNetlist(Tokenizer tokens, string& key) {
+    FingerprintHasher hasher;
+    hasher.add(to_string(CIRCUIT_IMAGE_VERSION));   // A new format version never matches old entries
+    int numChips;
+    if (!tokens.nextCount(numChips)) {
+        return false;
+    }
+    for (int i = 0; i < numChips; i++) {
+        hasher.add(tokens.next());
+    }
+    hasher.add("|");
+    int numCommands;
+    if (!tokens.nextCount(numCommands)) {
+        numCommands = 0;
+    }
+    bool queried = false;
+    for (int i = 0; i < numCommands; i++) {
+        string_view command = tokens.next();
+        if (command == "A") {
+            if (queried) {
+                return false;
+            }
+            hasher.add(tokens.next());
+            hasher.add(tokens.next());
+        } else if (command == "I") {
+            tokens.next();
+            tokens.next();
+        } else if (command == "O") {
+            tokens.next();
+            queried = true;
+        } else if (command == "Q") {
+            int numIds;
+            string_view first = tokens.next();
+            if (first != "*" && parseCount(first, numIds)) {
+                for (int j = 0; j < numIds; j++) {
+                    tokens.next();
+                }
+            }
+            queried = true;
+        } else if (command.empty()) {
+            break;
+        }
+    }
+    key = hasher.hex();
+    return true;
+}
+
+// Writes a random acyclic netlist of numChips chips for benchmarking. Each
+// chip reads a chip shortly before it in evaluation order, as in real
+// circuits built from local blocks, with an occasional long-range input. The
+// chips are declared in shuffled order, so declaration order says nothing
+// about evaluation order; every output chip is queried once with Q *.
+//
+// Values stay bounded however deep the circuit is, so timings are taken on
+// ordinary numbers rather than on infinities, NaNs or denormals: the second
+// input of a binary chip is an input chip, +1 or -1 for M and D chips and
+// an offset in [-1, 1] for A and S chips. Multiplying and dividing then keep
+// a value's magnitude, and each level adds at most 1 to it.
+string syntheticNetlist(uint32_t numChips, uint64_t seed) {
+    const uint32_t LOCAL_WINDOW = 64;
+    mt19937_64 random(seed);
+    uint32_t numInputs = max<uint32_t>(2, numChips / 100);
+    uint32_t numUnits = numInputs / 2;   // Inputs 0 to numUnits - 1 hold +1 or -1, the rest offsets
+    uint32_t numOutputs = max<uint32_t>(1, numChips / 1000);
+    numChips = max(numChips, numInputs + numOutputs);
+    const char OPERATORS[] = "AASSMMDN";
+    vector<string> ids(numChips);
+    for (uint32_t t = 0; t < numChips; t++) {
+        char type = t < numInputs ? 'I' : t >= numChips - numOutputs ? 'O' : OPERATORS[random() % 8];
+        ids[t] = type + to_string(t);
+    }
+    auto pickInput = [&](uint32_t t) {
+        if (random() % 10 == 0) {
+            return (uint32_t)(random() % t);   // Long-range input
+        }
+        uint32_t reach = min(t, LOCAL_WINDOW);
+        return t - 1 - (uint32_t)(random() % reach);
+    };
+
+    string text = to_string(numChips) + "\n";
+    vector<uint32_t> order(numChips);
+    for (uint32_t t = 0; t < numChips; t++) {
+        order[t] = t;
+    }
+    shuffle(order.begin(), order.end(), random);
+    for (uint32_t t : order) {
+        text.append(ids[t]).append("\n");
+    }
+    string commands;
+    uint64_t numCommands = 0;
+    for (uint32_t t = numInputs; t < numChips; t++) {
+        uint32_t first = pickInput(t);
+        char type = ids[t][0];
+        if (type != 'N' && type != 'O') {
+            uint32_t second = type == 'M' || type == 'D' ? (uint32_t)(random() % numUnits)
+                                                         : numUnits + (uint32_t)(random() % (numInputs - numUnits));
+            while (second == first) {
+                first = pickInput(t);   // Two distinct inputs; t >= 2 since inputs come first
+            }
+            commands.append("A ").append(ids[first]).append(" ").append(ids[t]).append("\n");
+            commands.append("A ").append(ids[second]).append(" ").append(ids[t]).append("\n");
+            numCommands += 2;
+        } else {
+            commands.append("A ").append(ids[first]).append(" ").append(ids[t]).append("\n");
+            numCommands++;
+        }
+    }
+    for (uint32_t t = 0; t < numInputs; t++) {
+        double value = t < numUnits ? (random() % 2 == 0 ? 1.0 : -1.0) : (double)((int)(random() % 2001) - 1000) / 1000;
+        commands.append("I ").append(ids[t]).append(" ").append(to_string(value)).append("\n");
+        numCommands++;
+    }
+    commands.append("Q *\n");
+    numCommands++;
+    text.append(to_string(numCommands)).append("\n").append(commands);
+    return text;
+}
 
-    // Returns the result computed by this chip
-    double getResult() const;
+// Counts the last-level cache misses of this thread between start() and
+// stop(), where the platform allows it
+class CacheMissCounter {
+private:
+    int fd;   // perf event descriptor, or -1 if counting is unavailable
 
-    // Sets the input value for input chips (used for testing input chips)
-    void setInputValue(double value) {
-        inputValue = value;
+public:
+    CacheMissCounter() {
+        fd = -1;
+#ifdef CHIPSIM_PERF_COUNTERS
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
     }
 
-    // Returns the first input chip (for internal logic and testing)
-    Chip* getInput1() const {
-        return input1;
+    ~CacheMissCounter() {
+#ifdef CHIPSIM_PERF_COUNTERS
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    // Returns false if misses cannot be counted (no counter, or not permitted)
+    bool available() const {
+        return fd >= 0;
+    }
+
+    void start() {
+#ifdef CHIPSIM_PERF_COUNTERS
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // Returns the misses counted since start()
+    uint64_t stop() {
+        uint64_t count = 0;
+#ifdef CHIPSIM_PERF_COUNTERS
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != (ssize_t)sizeof(count)) {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+};
+
+// Evaluation engines that can answer O queries
+enum EngineKind {
+    ENGINE_DEMAND,       // Memoized evaluation of the queried chip's inputs (Circuit::compute)
+    ENGINE_TAPE,         // Forward loop over the tape entries of the query's cone
+    ENGINE_INCREMENTAL,  // Re-evaluates only the tape entries affected by changed inputs
+    ENGINE_LEVELS,       // The query's cone, one level at a time across a thread pool
+    ENGINE_STEAL,        // The query's cone scheduled by dependency counts with work stealing
+    ENGINE_VM,           // The query's cone run as bytecode with threaded dispatch
+    ENGINE_JIT           // The query's cone compiled to x86-64 machine code (the VM elsewhere)
+};
+
+// Ties the registry, the circuit and its compiled form together and carries
+// out the commands of the input file
+class Simulator {
+private:
+    ChipRegistry registry;        // Chip ID interning
+    Circuit circuit;              // Chip storage and connections
+    CompiledCircuit compiled;     // Compiled tape for the tape, incremental and parallel engines
+    EngineKind engine;            // Engine used for O queries
+    ThreadPool pool;              // Threads for the parallel engines
+    OutputWriter& writer;         // Destination of everything the commands print
+    bool compiledValid;           // True while the tape matches the circuit's connections
+    uint64_t connectionErrors;    // A commands that named an unknown chip
+    uint64_t connectionWarnings;  // Duplicate and surplus connection warnings printed
+    vector<Circuit::Connection> pendingConnections;   // A commands not yet applied to the circuit
+    vector<ChipHandle> outputChips;   // Output chips among the first outputsScanned chips, for Q *
+    vector<ChipHandle> queried;       // The chip of the current O query, kept to reuse its storage
+    ChipHandle outputsScanned;        // Number of chips checked for outputChips
+    unique_ptr<InputSource> image;    // Circuit image the loaded arrays refer to, if any
+
+    // Applies the pending A commands to the circuit in one batch and warns
+    // about duplicate and surplus connections
+    void flushConnections();
+
+    // Compiles the circuit if connections changed since the last compile;
+    // returns false if some chips reach a cycle, which leaves the others
+    // ready to evaluate
+    bool ensureCompiled();
+
+    // Prints an error if any of the given chips reaches a cycle, naming a
+    // chip on the cycle the first of them reaches; returns true if one does
+    bool reportCycle(const vector<ChipHandle>& chips);
+
+    // Brings the values of the given chips up to date with the compiled
+    // engine in use and prints the division errors of their cone
+    void evaluateChips(const vector<ChipHandle>& chips);
+
+    // Computes several chips in one sweep and prints each value
+    void queryChips(const vector<ChipHandle>& chips);
+
+public:
+    Simulator(int expectedChips, EngineKind engine, unsigned threads, OutputWriter& writer);
+
+    // Declares a chip; its type is the first character of its ID
+    void declareChip(string_view id);
+
+    // Connects the output of one chip to an input of another (the A command).
+    // Connections are collected and applied in bulk before anything reads them.
+    void connect(string_view fromId, string_view toId);
+
+    // Sets the value of an input chip (the I command)
+    void setInputValue(string_view id, double value);
+
+    // Computes a chip and prints its value (the O command)
+    void query(string_view id);
+
+    // Computes a list of chips in one sweep and prints each value (the Q command)
+    void queryMany(const vector<string_view>& ids);
+
+    // Computes every output chip in one sweep and prints each value (Q *)
+    void queryOutputs();
+
+    // Reads a matrix of input vectors and prints every output chip's value
+    // for each row; returns false if the matrix is malformed
+    bool runBatch(Tokenizer& in, SimdLevel simd);
+
+    // Prints the connections that were established
+    void showConnections();
+
+    // Times full evaluations of the compiled circuit with its value slots in
+    // declaration order and in evaluation order, and with each way of
+    // dispatching the operations, and prints the results; returns false if
+    // the circuit has a cycle
+    bool benchmark();
+
+    // Returns how many A commands named an unknown chip
+    uint64_t getConnectionErrors() const {
+        return connectionErrors;
     }
+
+    // Returns how many connection warnings were printed; connections are
+    // checked when they are applied, at the latest by a compile
+    uint64_t getConnectionWarnings() const {
+        return connectionWarnings;
+    }
+
+    // Compiles the circuit if needed; returns false if it has a cycle
+    bool compile() {
+        return ensureCompiled();
+    }
+
+    // Compiles the circuit and writes it as a binary image; returns false on a cycle or write error
+    bool saveImage(const string& path);
+
+    // Replaces the circuit with a compiled binary image, which the simulator
+    // keeps and uses in place; returns false and leaves the simulator
+    // unchanged if the image is damaged or of another format version
+    bool loadImage(unique_ptr<InputSource> source);
 };
 
-// Constructor Implementation
-Chip::Chip(char type, const string& id) {
-    chipType = type;             // Set chip type (e.g., A, S, M)
-    this->id = id;               // Set the chip ID
-    input1 = nullptr;            // Initialize input1 as null
-    input2 = nullptr;            // Initialize input2 as null (optional)
-    output = nullptr;            // Output is initially null (set later)
+Simulator::Simulator(int expectedChips, EngineKind engine, unsigned threads, OutputWriter& writer)
+    : registry(expectedChips), circuit(expectedChips), pool(threads), writer(writer) {
+    this->engine = engine;
+    compiledValid = false;
+    connectionErrors = 0;
+    connectionWarnings = 0;
+    outputsScanned = 0;
+}
+
+void Simulator::declareChip(string_view id) {
+    char type = id.empty() ? '\0' : id[0];  // Determine the chip type based on the first character
+    registry.intern(id);                     // Intern the ID; handles follow declaration order
+    circuit.addChip(type);                   // Append the chip under the same handle
+    compiledValid = false;
 }
 
-void Chip::setInput1(Chip* inputChip) {
-    input1 = inputChip;          // Connect input1 to this chip
-    inputChip->setOutput(this);  // Set this chip as the output of inputChip
+void Simulator::connect(string_view fromId, string_view toId) {
+    // Resolve the input and output chips to their handles
+    ChipHandle from = registry.find(fromId);
+    ChipHandle to = registry.find(toId);
+    if (from == NO_CHIP || to == NO_CHIP) {
+        writer.error() << "Error: Unknown chip in connection " << fromId << " -> " << toId << endl;
+        connectionErrors++;
+        return;
+    }
+    pendingConnections.push_back(circuit.makeConnection(from, to));
+    compiledValid = false;  // The tape is rebuilt before the next query
+
+    // Batches are indexed with 32-bit edge numbers
+    const size_t MAX_PENDING_CONNECTIONS = (size_t)1 << 28;
+    if (pendingConnections.size() == MAX_PENDING_CONNECTIONS) {
+        flushConnections();
+    }
 }
 
-void Chip::setInput2(Chip* inputChip) {
-    input2 = inputChip;          // Connect input2 to this chip
-    inputChip->setOutput(this);  // Set this chip as the output of inputChip
+void Simulator::flushConnections() {
+    if (pendingConnections.empty()) {
+        return;
+    }
+    vector<Circuit::ConnectionIssue> issues;
+    circuit.connectAll(pendingConnections, pool, issues);
+    vector<Circuit::Connection>().swap(pendingConnections);   // A bulk load leaves nothing worth keeping
+
+    // Collected first so a netlist with many bad connections costs one write
+    string warnings;
+    for (const Circuit::ConnectionIssue& issue : issues) {
+        string_view name = registry.nameOf(issue.chip);
+        if (issue.duplicate) {
+            warnings.append("Warning: Chip ").append(name).append(" is connected to the same chip more than once\n");
+            connectionWarnings++;
+        }
+        if (issue.overArity) {
+            warnings.append("Warning: Chip ").append(name).append(" has more connections than inputs\n");
+            connectionWarnings++;
+        }
+    }
+    if (!warnings.empty()) {
+        writer.error() << warnings;
+    }
 }
 
-void Chip::setOutput(Chip* outputChip) {
-    output = outputChip;         // Connect this chip to outputChip
+void Simulator::setInputValue(string_view id, double value) {
+    ChipHandle chip = registry.find(id);
+    if (chip == NO_CHIP) {
+        return;
+    }
+    circuit.setInputValue(chip, value);
+    if (compiledValid && circuit.getChipType(chip) == 'I') {
+        compiled.setInputValue(chip, value);
+    }
 }
 
-// Perform the operation based on the chip type
-void Chip::compute() {
-    // If it's an input chip, directly return its value
-    if (chipType == 'I') {
-        result = inputValue;     // Input chip simply passes its value
+bool Simulator::ensureCompiled() {
+    flushConnections();
+    if (!compiledValid) {
+        compiled.compile(circuit, true);
+        compiledValid = true;
+    }
+    return compiled.getCycleChip() == NO_CHIP;
+}
+
+bool Simulator::reportCycle(const vector<ChipHandle>& chips) {
+    for (ChipHandle chip : chips) {
+        ChipHandle cycle = compiled.cycleThrough(chip);
+        if (cycle != NO_CHIP) {
+            writer.error() << "Error: Circuit contains a cycle through chip " << registry.nameOf(cycle) << endl;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Simulator::evaluateChips(const vector<ChipHandle>& chips) {
+    // The incremental engine already limits its work to what changed, so
+    // it keeps the whole circuit current and only needs the cone's divisions
+    // for the error messages
+    const CompiledCircuit::Cone& cone = compiled.coneOf(chips, engine == ENGINE_INCREMENTAL);
+    if (engine == ENGINE_INCREMENTAL) {
+        compiled.update();
+    } else if (engine == ENGINE_TAPE) {
+        compiled.run(cone);
+    } else if (engine == ENGINE_VM) {
+        compiled.runBytecode(cone);
+    } else if (engine == ENGINE_JIT) {
+        compiled.runNative(cone);
+    } else if (engine == ENGINE_LEVELS) {
+        compiled.runLevels(pool, cone);
+    } else if (engine == ENGINE_STEAL) {
+        compiled.runStealing(pool, cone);
+    }
+    compiled.reportDivisionErrors(registry, writer, cone);
+}
+
+void Simulator::query(string_view id) {
+    writer << "Computation Starts \n";
+    ChipHandle chip = registry.find(id);
+    if (chip == NO_CHIP) {
         return;
     }
 
-    // Compute the results of the input chips before performing this chip's operation
-    if (input1) input1->compute();   // Ensure input1 is computed
-    if (input2) input2->compute();   // Ensure input2 is computed if it exists
+    double value;
+    if (engine != ENGINE_DEMAND) {
+        ensureCompiled();
+        queried.assign(1, chip);
+        if (reportCycle(queried)) {
+            return;
+        }
+        evaluateChips(queried);
+        value = compiled.getValue(chip);
+    } else {
+        flushConnections();
+        circuit.compute(chip, registry, writer);
+        value = circuit.getResult(chip);
+    }
+    writer << "The output value from this circuit is " << value << '\n';
+}
+
+void Simulator::queryChips(const vector<ChipHandle>& chips) {
+    writer << "Computation Starts \n";
+    if (engine != ENGINE_DEMAND) {
+        ensureCompiled();
+        reportCycle(chips);
+        evaluateChips(chips);
+    } else {
+        flushConnections();
+        circuit.compute(chips, registry, writer);
+    }
+    for (ChipHandle chip : chips) {
+        if (engine != ENGINE_DEMAND && compiled.cycleThrough(chip) != NO_CHIP) {
+            continue;   // No value; the cycle was reported above
+        }
+        double value = engine != ENGINE_DEMAND ? compiled.getValue(chip) : circuit.getResult(chip);
+        writer << "The output value from " << registry.nameOf(chip) << " is " << value << '\n';
+    }
+}
+
+void Simulator::queryMany(const vector<string_view>& ids) {
+    vector<ChipHandle> chips;
+    chips.reserve(ids.size());
+    for (string_view id : ids) {
+        ChipHandle chip = registry.find(id);
+        if (chip != NO_CHIP) {
+            chips.push_back(chip);   // Unknown IDs are skipped, as with the O command
+        }
+    }
+    queryChips(chips);
+}
+
+void Simulator::queryOutputs() {
+    // Chip types never change, so only chips declared since the last scan are checked
+    for (; outputsScanned < circuit.size(); outputsScanned++) {
+        if (circuit.getChipType(outputsScanned) == 'O') {
+            outputChips.push_back(outputsScanned);
+        }
+    }
+    queryChips(outputChips);
+}
+
+bool Simulator::runBatch(Tokenizer& in, SimdLevel simd) {
+    // The header line names the input chip of each column
+    string_view header = in.nextLine();
+    Tokenizer headerTokens(header.data(), header.size());
+    vector<ChipHandle> columns;
+    for (string_view columnId = headerTokens.next(); !columnId.empty(); columnId = headerTokens.next()) {
+        ChipHandle chip = registry.find(columnId);
+        if (chip == NO_CHIP || circuit.getChipType(chip) != 'I') {
+            writer.error() << "Error: Batch column " << columnId << " is not an input chip" << endl;
+            return false;
+        }
+        columns.push_back(chip);
+    }
+    if (columns.empty()) {
+        writer.error() << "Error: Batch file has no input columns" << endl;
+        return false;
+    }
+    ensureCompiled();
+
+    // Every output chip is reported, in declaration order, except those that
+    // reach a cycle
+    vector<ChipHandle> outputs;
+    for (ChipHandle chip = 0; chip < circuit.size(); chip++) {
+        if (circuit.getChipType(chip) == 'O') {
+            outputs.push_back(chip);
+        }
+    }
+    if (reportCycle(outputs)) {
+        outputs.erase(remove_if(outputs.begin(), outputs.end(),
+                                [&](ChipHandle chip) { return compiled.cycleThrough(chip) != NO_CHIP; }),
+                      outputs.end());
+    }
+
+    // Rows are read and evaluated one block at a time; columns a row does not
+    // cover keep the values set by I commands
+    BatchEvaluator batch(compiled, simd);
+    uint32_t width = batch.getWidth();
+    uint64_t numRows = 0;
+    bool malformed = false;
+    writer << "***** Batch results\n";
+    for (size_t k = 0; k < outputs.size(); k++) {
+        writer << (k ? " " : "") << registry.nameOf(outputs[k]);
+    }
+    writer << '\n';
+    while (!malformed) {
+        uint32_t n = 0;
+        for (; n < width && !in.atEnd(); n++) {
+            size_t c = 0;
+            for (; c < columns.size(); c++) {
+                double value;
+                if (!in.nextDouble(value)) {
+                    break;
+                }
+                batch.lanesOf(compiled.getSlot(columns[c]))[n] = value;
+            }
+            if (c < columns.size()) {
+                malformed = true;
+                break;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        batch.evaluate(n);
+        for (uint32_t lane = 0; lane < n; lane++) {
+            for (size_t k = 0; k < outputs.size(); k++) {
+                writer << (k ? " " : "") << batch.lanesOf(compiled.getSlot(outputs[k]))[lane];
+            }
+            writer << '\n';
+        }
+        numRows += n;
+    }
 
-    // Perform operation based on the chip type
-    if (chipType == 'A') {            // Addition chip
-        result = input1->getResult() + input2->getResult();
+    // Division errors are summarized per chip instead of per vector
+    const ImageArray<TapeEntry>& tape = compiled.getTape();
+    for (uint32_t pos = 0; pos < tape.size(); pos++) {
+        if (tape[pos].op == OP_DIV && batch.getDivideFaults(pos) > 0) {
+            writer << "Error: Division by zero in chip " << registry.nameOf(compiled.getChip(tape[pos].dst))
+                 << " (" << batch.getDivideFaults(pos) << " of " << numRows << " vectors)" << '\n';
+        }
     }
-    else if (chipType == 'S') {       // Subtraction chip
-        result = input1->getResult() - input2->getResult();
+    if (malformed) {
+        writer.error() << "Error: Malformed value in batch file after row " << numRows << endl;
+        return false;
     }
-    else if (chipType == 'M') {       // Multiplication chip
-        result = input1->getResult() * input2->getResult();
+    return true;
+}
+
+bool Simulator::benchmark() {
+    // Enough repetitions for the timings to dwarf the clock resolution
+    const uint64_t TARGET_EVALUATIONS = 200000000;
+    flushConnections();
+    CompiledCircuit layouts[2];   // Value slots in declaration order, then in evaluation order
+    for (int renumber = 0; renumber < 2; renumber++) {
+        if (!layouts[renumber].compile(circuit, renumber != 0)) {
+            writer.error() << "Error: Circuit contains a cycle through chip "
+                           << registry.nameOf(layouts[renumber].getCycleChip()) << endl;
+            return false;
+        }
     }
-    else if (chipType == 'D') {       // Division chip
-        if (input2->getResult() != 0) {  // Handle division by zero
-            result = input1->getResult() / input2->getResult();
+    uint64_t entries = max<uint64_t>(1, layouts[0].getTape().size());
+    uint64_t runs = max<uint64_t>(3, TARGET_EVALUATIONS / entries);
+    writer << "***** Benchmark: " << layouts[0].getTape().size() << " tape entries, " << runs << " runs each\n";
+
+    // Times repeated full evaluations and prints the cost per tape entry
+    auto measure = [&](const char* label, const function<void()>& evaluate) {
+        evaluate();   // Warm up the caches and page in the arrays
+        CacheMissCounter misses;
+        auto started = chrono::steady_clock::now();
+        misses.start();
+        for (uint64_t r = 0; r < runs; r++) {
+            evaluate();
+        }
+        uint64_t missCount = misses.stop();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        double evaluations = (double)entries * runs;
+        writer << label << ": " << seconds * 1e9 / evaluations << " ns per entry, ";
+        if (misses.available()) {
+            writer << missCount / evaluations << " cache misses per entry\n";
         } else {
-            cout << "Error: Division by zero in chip " << id << endl;
-            result = 0;
+            writer << "cache misses not available\n";
+        }
+    };
+    measure("declaration order, switch dispatch", [&] { layouts[0].run(); });
+    measure("evaluation order, switch dispatch", [&] { layouts[1].run(); });
+    measure("evaluation order, table dispatch", [&] { layouts[1].runTable(); });
+    measure("evaluation order, bytecode VM", [&] { layouts[1].runBytecode(); });
+    if (NativeCode::supported()) {
+        measure("evaluation order, native code", [&] { layouts[1].runNative(); });
+    } else {
+        writer << "evaluation order, native code: not available on this platform\n";
+    }
+    return true;
+}
+
+void Simulator::showConnections() {
+    flushConnections();
+    writer << "***** Showing the connections that were established\n";
+    ChipHandle skipHandle = registry.find("O50");  // Output chip shown in the second pass
+    for (ChipHandle chip = 0; chip < circuit.size(); chip++) {
+        if (chip != skipHandle) {  // Skip output chip during this pass
+            circuit.display(chip, registry, writer);
         }
     }
-    else if (chipType == 'N') {  // Negation chip
-        if (input1->getResult() != 0) {
-            result = -input1->getResult();
-         }
+    for (ChipHandle chip = 0; chip < circuit.size(); ++chip) {
+        if (circuit.getChipType(chip) == 'O') {
+            circuit.display(chip, registry, writer);   // Show output connections last
+        }
     }
 }
 
-// Displays the chip's connections and output
-void Chip::display() const {
-    if (chipType == 'I') {  // Display for input chip
-        cout << id << ", Output = " << (output ? output->getId() : "None") << endl;
+bool Simulator::saveImage(const string& path) {
+    // The image has no record of which chips reach a cycle
+    if (!ensureCompiled()) {
+        writer.error() << "Error: Circuit contains a cycle through chip " << registry.nameOf(compiled.getCycleChip()) << endl;
+        return false;
     }
-    else if (chipType == 'O') {  // Display for output chip
-        cout << id << ", Input 1 = " << (input1 ? input1->getId() : "None") << endl;
+
+    // Write to a temporary name of this process and rename, so readers never
+    // see a partial image and concurrent writers never share a file
+    string temporary = path + ".tmp." + to_string(processId());
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
     }
-    else {  // Display for other chips with two inputs and an output
-        cout << id << ", Input 1 = " << (input1 ? input1->getId() : "None");
-        cout << ", Input 2 = " << (input2 ? input2->getId() : "None");
-        cout << ", Output = " << output->getId();
-        cout << endl;
+    ImageWriter image(file);
+    image.writeArray(CIRCUIT_IMAGE_MAGIC, sizeof(CIRCUIT_IMAGE_MAGIC));
+    image.writeValue(CIRCUIT_IMAGE_VERSION);
+    image.writeValue(CIRCUIT_IMAGE_BYTE_ORDER);
+    registry.save(image);
+    circuit.save(image);
+    compiled.save(image);
+    image.writeChecksum();
+    bool ok = image.ok();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Simulator::loadImage(unique_ptr<InputSource> source) {
+    ImageReader image(source->data(), source->size());
+    vector<char> magic;
+    uint32_t version = 0;
+    uint32_t byteOrder = 0;
+    if (!image.readArray(magic, sizeof(CIRCUIT_IMAGE_MAGIC)) ||
+        memcmp(magic.data(), CIRCUIT_IMAGE_MAGIC, sizeof(CIRCUIT_IMAGE_MAGIC)) != 0 ||
+        !image.readValue(version) || version != CIRCUIT_IMAGE_VERSION ||
+        !image.readValue(byteOrder) || byteOrder != CIRCUIT_IMAGE_BYTE_ORDER) {
+        return false;
+    }
+
+    // Load into scratch objects so a section that fails validation leaves
+    // the simulator exactly as it was
+    ChipRegistry loadedRegistry(0);
+    Circuit loadedCircuit(0);
+    CompiledCircuit loadedCompiled;
+    if (!loadedRegistry.load(image) || !loadedCircuit.load(image) || loadedRegistry.size() != loadedCircuit.size() ||
+        !loadedCompiled.load(image, loadedCircuit.size()) || !image.verifyChecksum()) {
+        return false;
+    }
+    registry = move(loadedRegistry);
+    circuit = move(loadedCircuit);
+    compiled = move(loadedCompiled);
+    this->image = move(source);   // Released only after nothing refers to the previous image
+    pendingConnections.clear();   // Made against the circuit being replaced
+    outputChips.clear();
+    outputsScanned = 0;
+    compiledValid = true;
+    return true;
+}
+
+// Directory of compiled circuit images named by netlist fingerprint, shared
+// by every simulator process that points at it. Entries are written under a
+// per-process temporary name and renamed into place, so readers only ever
+// see complete images; a damaged, outdated or forged entry fails the checks
+// of Simulator::loadImage() and is replaced. When the directory grows past its size limit the least
+// recently used entries are removed.
+class CircuitCache {
+private:
+    string directory;    // Cache location
+    uint64_t maxBytes;   // Size limit for all entries together
+
+    // Removes least recently used entries until the cache fits its limit
+    void evict();
+
+public:
+    CircuitCache(const string& directory, uint64_t maxBytes);
+
+    // Returns the path of the entry for a fingerprint
+    string pathFor(const string& key) const;
+
+    // Loads the entry for a fingerprint into the simulator; returns false on
+    // a miss, removing an entry that failed to load
+    bool load(const string& key, Simulator& simulator);
+
+    // Stores the simulator's compiled circuit under a fingerprint; does
+    // nothing if the circuit has a cycle or its connections were reported
+    void store(const string& key, Simulator& simulator);
+};
+
+CircuitCache::CircuitCache(const string& directory, uint64_t maxBytes) {
+    this->directory = directory;
+    this->maxBytes = maxBytes;
+    error_code ignored;
+    filesystem::create_directories(directory, ignored);
+}
+
+string CircuitCache::pathFor(const string& key) const {
+    return (filesystem::path(directory) / (key + ".ccimg")).string();
+}
+
+bool CircuitCache::load(const string& key, Simulator& simulator) {
+    string path = pathFor(key);
+    // Other processes can write to the directory, so the entry is copied
+    // rather than mapped: loadImage() checks every index in the copy, and
+    // nobody can change it afterwards
+    unique_ptr<InputSource> image(new InputSource());
+    if (!image->openFile(path, true)) {
+        return false;
+    }
+    error_code ignored;
+    if (!simulator.loadImage(move(image))) {
+        filesystem::remove(path, ignored);   // Damaged or outdated; the caller stores a fresh image
+        return false;
     }
+    filesystem::last_write_time(path, filesystem::file_time_type::clock::now(), ignored);   // Mark as recently used
+    return true;
 }
 
-string Chip::getId() const {
-    return id;  // Return the chip's unique ID
+void CircuitCache::store(const string& key, Simulator& simulator) {
+    // A circuit with a cycle is not cached, since the image does not record
+    // which chips reach it, and the cache reports nothing. Circuits whose
+    // connections printed errors or warnings are not cached either, since a
+    // cache hit skips the A commands and would not repeat them; compiling
+    // applies every connection first, so the counts are complete.
+    if (simulator.compile() && simulator.getConnectionErrors() == 0 &&
+        simulator.getConnectionWarnings() == 0 && simulator.saveImage(pathFor(key))) {
+        evict();
+    }
 }
 
-char Chip::getChipType() const {
-    return chipType;  // Return the chip type (A, S, M, etc.)
+void CircuitCache::evict() {
+#ifdef CHIPSIM_POSIX_IO
+    // One process evicts at a time; the others skip eviction rather than wait
+    string lockPath = (filesystem::path(directory) / ".lock").string();
+    int lockFd = open(lockPath.c_str(), O_CREAT | O_RDWR, 0644);
+    if (lockFd < 0) {
+        return;
+    }
+    if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+        close(lockFd);
+        return;
+    }
+#endif
+    struct Entry {
+        filesystem::path path;
+        uint64_t bytes;
+        filesystem::file_time_type used;
+    };
+    vector<Entry> entries;
+    uint64_t total = 0;
+    error_code error;
+    auto staleBefore = filesystem::file_time_type::clock::now() - chrono::hours(1);
+    for (const filesystem::directory_entry& item : filesystem::directory_iterator(directory, error)) {
+        string name = item.path().filename().string();
+        Entry entry;
+        entry.path = item.path();
+        entry.bytes = item.file_size(error);
+        entry.used = item.last_write_time(error);
+        if (error) {
+            error.clear();
+            continue;   // Removed by another process meanwhile
+        }
+        if (name.find(".ccimg.tmp.") != string::npos) {
+            if (entry.used < staleBefore) {
+                filesystem::remove(entry.path, error);   // Left behind by a process that died mid-write
+            }
+            continue;
+        }
+        if (entry.path.extension() == ".ccimg") {
+            entries.push_back(entry);
+            total += entry.bytes;
+        }
+    }
+    sort(entries.begin(), entries.end(), [](const Entry& x, const Entry& y) { return x.used < y.used; });
+    for (size_t i = 0; i < entries.size() && total > maxBytes; i++) {
+        // Readers that already mapped an entry keep their mapping after removal
+        filesystem::remove(entries[i].path, error);
+        total -= entries[i].bytes;
+    }
+#ifdef CHIPSIM_POSIX_IO
+    flock(lockFd, LOCK_UN);
+    close(lockFd);
+#endif
 }
 
-double Chip::getResult() const {
-    return result;  // Return the result of the chip's operation
+// Prints the command line options
+void printUsage(const char* program) {
+    cerr << "Usage: " << program << " [--engine=demand|tape|incremental|levels|steal|vm|jit] [--threads=N]\n"
+         << "       [--batch=FILE] [--simd=auto|scalar|avx2|avx512]\n"
+         << "       [--save-circuit=FILE] [--load-circuit=FILE]\n"
+         << "       [--cache-dir=DIR] [--cache-max-bytes=N] [--bench] [--synthetic=N] [input.txt]\n"
+         << "Reads the netlist from input.txt, or from standard input if no file is given.\n"
+         << "--save-circuit writes the compiled circuit after the commands have run.\n"
+         << "With --load-circuit the input holds only the command count and the commands.\n"
+         << "--cache-dir reuses compiled circuits of netlists seen before (default limit 1 GiB).\n"
+         << "--synthetic=N replaces the input with a generated circuit of N chips.\n"
+         << "--bench times evaluation of the circuit after the commands instead of showing connections.\n"
+         << "The command Q <count> <id>... prints several chips in one sweep; Q * prints every O chip." << endl;
 }
 
 // Main function
-int main(){
-    // Step 1: Read the number of Chips from input
-    int numChips;
-    cin >> numChips;
+int main(int argc, char* argv[]){
+    // Step 0: Parse the command line options
+    EngineKind engine = ENGINE_INCREMENTAL;
+    string batchPath;   // Matrix of input vectors to evaluate after the commands, if any
+    SimdLevel simd = SIMD_AUTO;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    string inputPath;   // Netlist file; standard input if empty
+    string saveCircuitPath;   // Compiled image to write after the commands, if any
+    string loadCircuitPath;   // Compiled image to start from instead of chip declarations, if any
+    string cacheDir;          // Directory of cached compiled circuits, if any
+    uint64_t cacheMaxBytes = (uint64_t)1 << 30;
+    bool bench = false;           // Benchmark evaluation after the commands instead of the usual report
+    uint32_t syntheticChips = 0;  // Size of a generated netlist to use instead of the input, if any
+    for (int i = 1; i < argc; i++) {
+        string_view arg = argv[i];
+        if (arg == "--engine=demand") {
+            engine = ENGINE_DEMAND;
+        } else if (arg == "--engine=tape") {
+            engine = ENGINE_TAPE;
+        } else if (arg == "--engine=incremental") {
+            engine = ENGINE_INCREMENTAL;
+        } else if (arg == "--engine=levels") {
+            engine = ENGINE_LEVELS;
+        } else if (arg == "--engine=steal") {
+            engine = ENGINE_STEAL;
+        } else if (arg == "--engine=vm") {
+            engine = ENGINE_VM;
+        } else if (arg == "--engine=jit") {
+            engine = ENGINE_JIT;
+        } else if (arg.substr(0, 10) == "--threads=") {
+            int requested = atoi(argv[i] + 10);
+            if (requested < 1) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            threads = (unsigned)requested;
+        } else if (arg.substr(0, 8) == "--batch=") {
+            batchPath = string(arg.substr(8));
+        } else if (arg == "--simd=auto") {
+            simd = SIMD_AUTO;
+        } else if (arg == "--simd=scalar") {
+            simd = SIMD_SCALAR;
+        } else if (arg == "--simd=avx2") {
+            simd = SIMD_AVX2;
+        } else if (arg == "--simd=avx512") {
+            simd = SIMD_AVX512;
+        } else if (arg.substr(0, 15) == "--save-circuit=") {
+            saveCircuitPath = string(arg.substr(15));
+        } else if (arg.substr(0, 15) == "--load-circuit=") {
+            loadCircuitPath = string(arg.substr(15));
+        } else if (arg.substr(0, 12) == "--cache-dir=") {
+            cacheDir = string(arg.substr(12));
+        } else if (arg.substr(0, 18) == "--cache-max-bytes=") {
+            cacheMaxBytes = strtoull(argv[i] + 18, nullptr, 10);
+        } else if (arg == "--bench") {
+            bench = true;
+        } else if (arg.substr(0, 12) == "--synthetic=") {
+            long requested = atol(argv[i] + 12);
+            if (requested < 2 || requested >= (long)NO_CHIP) {
+                printUsage(argv[0]);
+                return 1;
+            }
+            syntheticChips = (uint32_t)requested;
+        } else if (arg.substr(0, 2) != "--" && inputPath.empty()) {
+            inputPath = string(arg);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
 
-    // Step 2: Create an array of Chip pointers
-    Chip** allChips = new Chip*[numChips];
+    // Step 1: Load the netlist and read the number of Chips
+    InputSource source;
+    bool loaded = true;
+    if (syntheticChips > 0) {
+        source.openText(syntheticNetlist(syntheticChips, 1));
+    } else {
+        loaded = inputPath.empty() ? source.openStdin() : source.openFile(inputPath);
+    }
+    if (!loaded) {
+        cerr << "Error: Cannot read input " << (inputPath.empty() ? "from standard input" : inputPath) << endl;
+        return 1;
+    }
+    Tokenizer tokens(source.data(), source.size());
+    OutputWriter writer(stdout);
+    int numChips = 0;
+    if (loadCircuitPath.empty() && !tokens.nextCount(numChips)) {
+        writer.error() << "Error: Expected the number of chips" << endl;
+        return 1;
+    }
 
-    // Step 3: Initialize the chips by reading their IDs and creating Chip objects
-    for(int i = 0; i < numChips; i++){
-        string chipId;
-        cin >> chipId;
+    // Step 2: Create the simulator that holds the circuit and the ID registry
+    Simulator simulator(numChips, engine, threads, writer);
 
-        char type = chipId[0];           // Determine the chip type based on the first character
-        allChips[i] = new Chip(type, chipId);  // Create and store the Chip object
+    // Step 3: Declare the chips by reading their IDs, or take the whole
+    // compiled circuit from a binary image or the circuit cache; a circuit
+    // that was loaded already has all of its connections
+    unique_ptr<CircuitCache> cache;
+    string cacheKey;
+    bool connected = false;
+    if (!cacheDir.empty() && loadCircuitPath.empty() && fingerprintNetlist(Tokenizer(source.data(), source.size()), cacheKey)) {
+        cache.reset(new CircuitCache(cacheDir, cacheMaxBytes));
+        connected = cache->load(cacheKey, simulator);
+    }
+    if (connected) {
+        for(int i = 0; i < numChips; i++){
+            tokens.next();   // Declarations are already part of the cached circuit
+        }
+    } else if (loadCircuitPath.empty()) {
+        for(int i = 0; i < numChips; i++){
+            simulator.declareChip(tokens.next());
+        }
+    } else {
+        unique_ptr<InputSource> image(new InputSource());
+        if (!image->openFile(loadCircuitPath) || !simulator.loadImage(move(image))) {
+            writer.error() << "Error: Cannot load compiled circuit " << loadCircuitPath
+                           << " (missing, damaged or from another format version)" << endl;
+            return 1;
+        }
     }
 
     // Step 4: Read the number of commands to process
     int numCommands;
-    cin >> numCommands;
+    if (!tokens.nextCount(numCommands)) {
+        numCommands = 0;   // A netlist without commands only shows its (empty) connections
+    }
 
     // Step 5: Process each command
     for(int i = 0; i < numCommands; i++){
-        string command;
-        cin >> command;
+        string_view command = tokens.next();
 
         if (command == "A") {   // If command is to add a connection between chips
-            string inputId, outputId;
-            cin >> inputId >> outputId;
-
-            Chip* inputChip = nullptr;
-            Chip* outputChip = nullptr;
-
-            // Find the input and output chips in the array
-            for(int j = 0; j < numChips; j++){
-                if(allChips[j]->getId() == inputId){
-                    inputChip = allChips[j];
-                }
-                if(allChips[j]->getId() == outputId){
-                    outputChip = allChips[j];
-                }
-            }
-
-            // Make appropriate connections based on the chip types
-            if (outputChip->getChipType() == 'N' || outputChip->getChipType() == 'O') {
-                outputChip->setInput1(inputChip);  // Negation/output chips take only one input
-            }
-            else if (outputChip->getChipType() == 'A' || outputChip->getChipType() == 'S' || outputChip->getChipType() == 'M' || outputChip->getChipType() == 'D') {
-                if (outputChip->getInput1() == nullptr) {
-                    outputChip->setInput1(inputChip);
-                }
-                else {
-                    outputChip->setInput2(inputChip);
-                }
+            string_view inputId = tokens.next();
+            string_view outputId = tokens.next();
+            if (!connected) {
+                simulator.connect(inputId, outputId);
             }
         }
         else if (command == "I") {   // If command is to set input values for input chips
-            string chipId;
+            string_view chipId = tokens.next();
             double value;
-            cin >> chipId >> value;
-
-            // Find the input chip and set its value
-            for (int j = 0; j < numChips; j++) {
-                if (allChips[j]->getId() == chipId) {
-                    allChips[j]->setInputValue(value);
-                    break;
-                }
+            if (!tokens.nextDouble(value)) {
+                writer.error() << "Error: Malformed value for input chip " << chipId << endl;
+                return 1;
             }
+            simulator.setInputValue(chipId, value);
         }
         else if (command == "O") {   // If command is to output the result of a chip
-            string outputChipId;
-            cin >> outputChipId;
-
-            // Find the output chip, compute its result, and display it
-            cout << "Computation Starts " << endl;
-            for (int j = 0; j < numChips; j++) {
-                if (allChips[j]->getId() == outputChipId) {
-                    if (allChips[j]->getChipType() == 'O') {
-                        allChips[j]->compute();  // Compute the result
-                        cout << "The output value from this circuit is " << allChips[j]->getInput1()->getResult() << endl;
-                    } else {
-                        allChips[j]->compute();
-                        cout << "The output value from this circuit is " << allChips[j]->getResult() << endl;
-                    }
-                    break;
+            simulator.query(tokens.next());
+        }
+        else if (command == "Q") {   // If command is to output several chips, or * for every output chip
+            string_view first = tokens.next();
+            if (first == "*") {
+                simulator.queryOutputs();
+                continue;
+            }
+            int numIds;
+            if (!parseCount(first, numIds)) {
+                writer.error() << "Error: Malformed chip count in Q command" << endl;
+                return 1;
+            }
+            vector<string_view> ids;
+            for (int j = 0; j < numIds; j++) {
+                string_view id = tokens.next();
+                if (id.empty()) {
+                    break;   // Fewer IDs than announced
                 }
+                ids.push_back(id);
             }
+            simulator.queryMany(ids);
+        }
+        else if (command.empty()) {
+            break;   // Fewer commands than announced
         }
     }
 
-    // Step 6: Display the connections that were established
-    cout << "***** Showing the connections that were established" << endl;
-    for(int i = 0; i < numChips; i++){
-        if (allChips[i]->getId() != "O50") { // Skip output chip during this pass
-            allChips[i]->display();
-        }
+    // Benchmarking replaces the remaining steps
+    if (bench) {
+        bool ok = simulator.benchmark();
+        writer.flush();
+        return ok ? 0 : 1;
     }
-    for (int i = 0; i < numChips; ++i) {
-        if (allChips[i]->getChipType() == 'O') {
-            allChips[i]->display();   // Show output connections last
+
+    // Step 6: Evaluate the batch of input vectors, if one was given
+    if (!batchPath.empty()) {
+        InputSource batchSource;
+        if (!batchSource.openFile(batchPath)) {
+            writer.error() << "Error: Cannot open batch file " << batchPath << endl;
+            return 1;
+        }
+        Tokenizer batchTokens(batchSource.data(), batchSource.size());
+        if (!simulator.runBatch(batchTokens, simd)) {
+            return 1;
         }
     }
 
-    // Clean up dynamically allocated memory
-    for(int i = 0; i < numChips; i++){
-        delete allChips[i];  // Free each chip object
+    // Step 7: Write the compiled circuit, if requested, and cache it for the
+    // next run of the same netlist unless the cache turns it down
+    if (cache && !connected) {
+        cache->store(cacheKey, simulator);
     }
-    delete[] allChips;       // Free the array of chip pointers
+    if (!saveCircuitPath.empty() && !simulator.saveImage(saveCircuitPath)) {
+        writer.error() << "Error: Cannot write compiled circuit " << saveCircuitPath << endl;
+        return 1;
+    }
+
+    // Step 8: Display the connections that were established
+    simulator.showConnections();
+    writer.flush();
 
+    // The circuit's arrays are released together when the simulator goes out of scope
     return 0;
 }